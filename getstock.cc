@@ -15,6 +15,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,21 +24,35 @@
 #include <algorithm>    /* rotate, find_if */
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close */
+#include <sys/mman.h>  /* mmap */
 #include <sys/stat.h>  /* see stat(2), mkdir(2) */
 #include <sys/types.h>
+#include <dirent.h>    /* opendir */
 
 #include <curl/curl.h>
+#include <omp.h>
 
 using namespace std;
 
 /* date format used for file naming */
 #define DATE_FMT "%Y-%m-%d"
+/* per-directory file of HTTP validators, see load_validators */
+#define VALIDATORS_FILE ".validators"
+/* temporary files (see make_tempfile) older than this are left over from a crashed run */
+#define PART_MAX_AGE 3600
 
-static const string urlbase = "https://www.quandl.com/api/v3/datasets/WIKI/";
+/* permissions of the files we write, as fopen would give them: 0666 less the umask */
+static mode_t file_mode = 0644;
+
+static string urlbase = "https://www.quandl.com/api/v3/datasets/WIKI/";
 
 int database_init(char const *path)
 {
@@ -158,9 +173,10 @@ string make_url(string const & ticker,
  * make_filename("/path/to/dir","TICKER","begin","end") = "/path/to/dir/TICKER.begin.end.csv"
  * where:
  *   begin, end are of the form YYYY-mm-dd
+ * 'ext' replaces ".csv", e.g. ".bin" for binary files
  */
 string make_filename(string const & dbroot, string const & ticker,
-                          char const *begin, char const *end)
+                          char const *begin, char const *end, char const *ext = ".csv")
 {
 	stringstream fname;
 	fname << dbroot;
@@ -171,42 +187,84 @@ string make_filename(string const & dbroot, string const & ticker,
 	if (begin && end) {
 		fname << '.' << begin << '.' << end;
 	}
-	fname << ".csv";
+	fname << ext;
 	return fname.str();
 }
 
-/* get paths to all files in database */
-vector<string> get_db_files(string const & dbroot)
+/*
+ * the files in the database by ticker (upper case), from one pass over the
+ * directory. Unlike a shell glob this has no limit on the number of files.
+ * Temporary files left behind by a crashed run are removed on the way; recent
+ * ones are kept, as they may belong to another getstock still running.
+ */
+typedef map<string, vector<string> > catalog;
+
+catalog get_db_files(string const & dbroot)
 {
-	char command[512];
-	char buf[512];
-	FILE *ls;
-	vector<string> files;
+	catalog files;
+	DIR *dir;
+	struct dirent *ent;
 
-	sprintf(command, "ls %s/*.csv 2>/dev/null", dbroot.c_str());
-	ls = popen(command, "r");
-	while (fgets(buf, sizeof buf, ls)) {
-		strip(buf);
-		files.emplace_back(buf);
+	dir = opendir(dbroot.c_str());
+	if (!dir)
+		return files;
+	while ((ent = readdir(dir))) {
+		char const *name = ent->d_name;
+		size_t len = strlen(name);
+		char const *dot = strchr(name, '.');
+		if (len < 4 || dot == name)
+			continue;
+		if (strstr(name, ".part.")) {
+			struct stat st;
+			if (fstatat(dirfd(dir), name, &st, 0) == 0 &&
+			    time(NULL) - st.st_mtime > PART_MAX_AGE)
+				unlinkat(dirfd(dir), name, 0);
+			continue;
+		}
+		if (strcmp(name + len - 4, ".csv") != 0 && strcmp(name + len - 4, ".bin") != 0)
+			continue;
+		files[upper(string(name, dot).c_str())].push_back(dbroot + "/" + name);
 	}
-	pclose(ls);
+	closedir(dir);
 	return files;
 }
 
-vector<string>::iterator
-find_file_by_ticker(string const & ticker,
-                    vector<string> & files)
-
+/* find a file for 'ticker' with the extension 'ext', or NULL */
+string *find_file_by_ticker(string const & ticker, catalog & files, char const *ext = ".csv")
 {
-	char const *t = ticker.c_str();
-	auto it = files.begin();
-	for ( ; it != files.end(); it++) {
-		char const *fstr = it->c_str();
-		if (strcasestr(fstr, t) != NULL) {
-			return it;
-		}
+	size_t extlen = strlen(ext);
+	auto it = files.find(ticker);
+	if (it == files.end())
+		return NULL;
+	for (auto & f : it->second) {
+		if (f.size() >= extlen && f.compare(f.size() - extlen, extlen, ext) == 0)
+			return &f;
 	}
-	return it;
+	return NULL;
+}
+
+/* the name of a file, without the directory */
+string basename_of(string const & path)
+{
+	auto slash = path.rfind('/');
+	return (slash == string::npos) ? path : path.substr(slash + 1);
+}
+
+/*
+ * dates_from_filename("/path/to/dir/TICKER.begin.end.csv", &begin, &end)
+ * sets begin and end. returns 0 if the filename does not have dates in it.
+ */
+int dates_from_filename(string const & filename, string *begin, string *end)
+{
+	string name = basename_of(filename);
+	auto b = name.find('.');
+	auto e = (b == string::npos) ? b : name.find('.', b + 1);
+	auto ext = (e == string::npos) ? e : name.find('.', e + 1);
+	if (ext == string::npos)
+		return 0;
+	*begin = name.substr(b + 1, e - b - 1);
+	*end = name.substr(e + 1, ext - e - 1);
+	return 1;
 }
 
 /* check if _filename includes the dates specified */
@@ -268,10 +326,441 @@ int has_data(string const & _filename, char const *a_begin, char const *a_end)
  */
 size_t curl_callback_fwrite(void *buf, size_t size, size_t nmemb, void *file)
 {
-	fwrite(buf, size, nmemb, (FILE *)file);
+	/* a short count makes curl abort the transfer, e.g. when the disk is full */
+	return fwrite(buf, 1, size * nmemb, (FILE *)file);
+}
+
+/* split one line (without its newline) of a CSV file into fields */
+vector<string> split_fields(char const *begin, char const *end)
+{
+	vector<string> fields;
+	char const *p;
+
+	for (p = begin; ; p++) {
+		if (p == end || *p == ',') {
+			fields.emplace_back(begin, p);
+			begin = p + 1;
+			if (p == end)
+				break;
+		}
+	}
+	return fields;
+}
+
+/*
+ * Binary price files, written with -B, hold the dates and closing prices of
+ * a ticker ready for main to use, without any parsing:
+ *   char     magic[8]     BINARY_MAGIC
+ *   uint64_t n            number of rows
+ *   int64_t  dates[n]     Unix time, parsed from DATE_FMT with mktime(3) as main does
+ *   double   closes[n]    Adj. Close, or Close if there is no Adj. Close
+ */
+#define BINARY_MAGIC "M4300BN1"
+
+/*
+ * An incremental CSV parser. Data is fed to it in pieces as it arrives from
+ * the network, and complete lines are parsed straight into columns, so that
+ * by the time a download finishes it is ready to be written out.
+ */
+struct csv_stream {
+	string partial;       /* an incomplete line left over from the last piece */
+	int header;           /* the header line has been read */
+	int bad;              /* the data is not in the format we expect */
+	int date_index, close_index;
+	vector<int64_t> dates;
+	vector<double> closes;
+
+	csv_stream() : header(0), bad(0), date_index(-1), close_index(-1) {}
+};
+
+/* pointer to field 'n' of a CSV line, or NULL if it has fewer fields */
+char const *nth_field(char const *line, char const *end, int n)
+{
+	for ( ; n > 0; n--) {
+		line = (char const *) memchr(line, ',', end - line);
+		if (!line)
+			return NULL;
+		line++;
+	}
+	return line;
+}
+
+void csv_stream_line(csv_stream *cs, char const *line, char const *end)
+{
+	char buf[64];
+	char const *f, *fend;
+
+	if (end > line && end[-1] == '\r')
+		end--;
+	if (end == line || cs->bad)
+		return;
+	if (!cs->header) {
+		auto fields = split_fields(line, end);
+		for (int i = 0; i < (int) fields.size(); i++) {
+			if (strcasecmp(fields[i].c_str(), "Date") == 0)
+				cs->date_index = i;
+			if (strcasecmp(fields[i].c_str(), "Adj. Close") == 0 ||
+			    (cs->close_index == -1 && strcasecmp(fields[i].c_str(), "Close") == 0))
+				cs->close_index = i;
+		}
+		cs->header = 1;
+		cs->bad = cs->date_index == -1 || cs->close_index == -1;
+		return;
+	}
+
+	struct tm tm;
+	f = nth_field(line, end, cs->date_index);
+	if (!f)
+		return;
+	fend = (char const *) memchr(f, ',', end - f);
+	fend = fend ? fend : end;
+	snprintf(buf, sizeof buf, "%.*s", (int) (fend - f), f);
+	memset(&tm, 0, sizeof tm);
+	if (!strptime(buf, DATE_FMT, &tm))
+		return;
+
+	f = nth_field(line, end, cs->close_index);
+	if (!f)
+		return;
+	fend = (char const *) memchr(f, ',', end - f);
+	fend = fend ? fend : end;
+	snprintf(buf, sizeof buf, "%.*s", (int) (fend - f), f);
+	char *endptr;
+	double close = strtod(buf, &endptr);
+	if (endptr == buf)
+		return;
+	cs->dates.push_back(mktime(&tm));
+	cs->closes.push_back(close);
+}
+
+void csv_stream_feed(csv_stream *cs, char const *buf, size_t len)
+{
+	char const *end = buf + len;
+	char const *nl;
+
+	if (!cs->partial.empty()) {
+		nl = (char const *) memchr(buf, '\n', len);
+		if (!nl) {
+			cs->partial.append(buf, len);
+			return;
+		}
+		cs->partial.append(buf, nl);
+		csv_stream_line(cs, cs->partial.data(), cs->partial.data() + cs->partial.size());
+		cs->partial.clear();
+		buf = nl + 1;
+	}
+	while ((nl = (char const *) memchr(buf, '\n', end - buf))) {
+		csv_stream_line(cs, buf, nl);
+		buf = nl + 1;
+	}
+	cs->partial.assign(buf, end);
+}
+
+/* parse whatever is left after the last piece. returns 0 if the data was good */
+int csv_stream_finish(csv_stream *cs)
+{
+	if (!cs->partial.empty()) {
+		csv_stream_line(cs, cs->partial.data(), cs->partial.data() + cs->partial.size());
+		cs->partial.clear();
+	}
+	return (cs->header && !cs->bad) ? 0 : -1;
+}
+
+/* write the parsed columns to 'path' in the binary format. returns 0 on success */
+int write_binary(string const & path, csv_stream const & cs)
+{
+	uint64_t n = cs.dates.size();
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file) {
+		perror(path.c_str());
+		return -1;
+	}
+	int ok = fwrite(BINARY_MAGIC, 1, 8, file) == 8 &&
+	         fwrite(&n, sizeof n, 1, file) == 1 &&
+	         fwrite(cs.dates.data(), sizeof(int64_t), n, file) == n &&
+	         fwrite(cs.closes.data(), sizeof(double), n, file) == n;
+	if (fclose(file) != 0 || !ok) {
+		perror(path.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Curl Callback to parse the data as it arrives, see csv_stream
+ */
+size_t curl_callback_parse(void *buf, size_t size, size_t nmemb, void *cs)
+{
+	csv_stream_feed((csv_stream *) cs, (char const *) buf, size * nmemb);
 	return size * nmemb;
 }
 
+
+/*
+ * Writing files safely
+ *
+ * Every file is written under a temporary name in the same directory, and
+ * renamed to its real name once it is complete, so a download that fails or
+ * is interrupted never leaves a truncated file behind a valid name (which
+ * has_data would accept). To survive a crash as well, the data must reach
+ * the disk before the rename does. Rather than fsync(2) each file, which
+ * costs a disk round trip per ticker, finished files are collected into a
+ * batch, and a single syncfs(2) flushes the whole batch before any of them is
+ * renamed. A second sync of the directory then makes the renames durable.
+ */
+#define SYNC_BATCH 64   /* files per syncfs */
+
+struct commit_batch {
+	int dirfd;                              /* the output directory */
+	vector<pair<string, string> > renames;  /* temporary name -> real name */
+	vector<string> obsolete;                /* files replaced by this batch */
+	vector<string> output;                  /* filenames to print once committed */
+};
+
+/*
+ * make_tempfile
+ *   create an empty, uniquely named file next to 'filename' (so that it can
+ *   be renamed over it). returns its name and sets *fd, or "" on error.
+ *   The names do not end in .csv or .bin, so get_db_files never lists them.
+ *   mkstemp creates the file private (0600); it is given file_mode so that
+ *   once renamed into place it is as readable as the file it replaces.
+ */
+string make_tempfile(string const & filename, int *fd)
+{
+	string tmp = filename + ".part.XXXXXX";
+	*fd = mkstemp(&tmp[0]);
+	if (*fd == -1) {
+		perror(tmp.c_str());
+		return "";
+	}
+	if (fchmod(*fd, file_mode) == -1)
+		perror(tmp.c_str());
+	return tmp;
+}
+
+/* make the files in the batch durable, move them into place, and print their names */
+void batch_commit(commit_batch *b)
+{
+	if (!b->renames.empty() && syncfs(b->dirfd) == -1)
+		perror("syncfs");
+	for (auto const & r : b->renames) {
+		if (rename(r.first.c_str(), r.second.c_str()) == -1) {
+			perror(r.second.c_str());
+			remove(r.first.c_str());
+		}
+	}
+	for (auto const & f : b->obsolete)
+		remove(f.c_str());
+	if ((!b->renames.empty() || !b->obsolete.empty()) && fsync(b->dirfd) == -1)
+		perror("fsync");
+	for (auto const & f : b->output)
+		printf("%s\n", f.c_str());
+	fflush(stdout);
+	b->renames.clear();
+	b->obsolete.clear();
+	b->output.clear();
+}
+
+/* add a finished file to the batch, and commit the batch if it is full */
+void batch_add(commit_batch *b, string const & tmp, string const & filename)
+{
+	b->renames.emplace_back(tmp, filename);
+	b->output.push_back(filename);
+	if ((int) b->renames.size() >= SYNC_BATCH)
+		batch_commit(b);
+}
+
+/*
+ * HTTP response validators for a downloaded file. When we have them, a
+ * download becomes a conditional request, and the server answers
+ * '304 Not Modified' with no body if the data has not changed since.
+ */
+struct validators {
+	string etag;
+	string last_modified;
+};
+
+/*
+ * The validators of every file in a directory are kept in a small text file,
+ * dbroot/.validators, one line per file:
+ *   filename <TAB> etag <TAB> last-modified
+ * with '-' for a validator the server did not send.
+ */
+map<string, validators> load_validators(string const & dbroot)
+{
+	map<string, validators> vs;
+	ifstream file{dbroot + "/" VALIDATORS_FILE};
+	string line;
+
+	while (getline(file, line)) {
+		stringstream ss(line);
+		string name;
+		validators v;
+		if (!getline(ss, name, '\t') || !getline(ss, v.etag, '\t') || !getline(ss, v.last_modified))
+			continue;
+		if (v.etag == "-")
+			v.etag.clear();
+		if (v.last_modified == "-")
+			v.last_modified.clear();
+		vs[name] = v;
+	}
+	return vs;
+}
+
+/* write the validators, to be moved into place when the batch 'b' is committed */
+void save_validators(string const & dbroot, map<string, validators> const & vs, commit_batch *b)
+{
+	string path = dbroot + "/" VALIDATORS_FILE;
+	int fd;
+	string tmp = make_tempfile(path, &fd);
+	FILE *file = tmp.empty() ? NULL : fdopen(fd, "w");
+	if (!file) {
+		perror("save_validators");
+		return;
+	}
+	for (auto const & pair : vs) {
+		fprintf(file, "%s\t%s\t%s\n", pair.first.c_str(),
+		        pair.second.etag.empty() ? "-" : pair.second.etag.c_str(),
+		        pair.second.last_modified.empty() ? "-" : pair.second.last_modified.c_str());
+	}
+	if (fclose(file) != 0) {
+		perror("save_validators");
+		remove(tmp.c_str());
+		return;
+	}
+	b->renames.emplace_back(tmp, path);
+}
+
+/*
+ * Curl Callback for the response headers, to pick out the validators.
+ * Called once per header line, which is not nul terminated.
+ */
+size_t curl_callback_header(char *buf, size_t size, size_t nmemb, void *data)
+{
+	validators *v = (validators *) data;
+	size_t len = size * nmemb;
+	string line(buf, len);
+	string *dest = NULL;
+
+	if (line.compare(0, 5, "HTTP/") == 0) {
+		/* status line of a new response (e.g. after a redirect) */
+		v->etag.clear();
+		v->last_modified.clear();
+	} else if (strncasecmp(line.c_str(), "ETag:", 5) == 0) {
+		dest = &v->etag;
+	} else if (strncasecmp(line.c_str(), "Last-Modified:", 14) == 0) {
+		dest = &v->last_modified;
+	}
+	if (dest) {
+		*dest = line.substr(line.find(':') + 1);
+		strip(dest);
+	}
+	return len;
+}
+
+/* totals over all the downloads, reported at exit */
+struct transfer_stats {
+	long requests;
+	long not_modified;
+	curl_off_t bytes;   /* headers and bodies */
+};
+
+/*
+ * download
+ *   fetch 'url' for 'filename' into a temporary file, see make_tempfile.
+ *   If the status is 200, *tmp is the name of the complete temporary file, for
+ *   the caller to move into place (see commit_batch). Otherwise it has been
+ *   removed, so a '304 Not Modified' response or a failure leaves any
+ *   existing file as is.
+ *   If 'binary' is set, the CSV data is parsed while it downloads and written
+ *   in the binary format instead.
+ *   'v' is in/out: the validators to make the request conditional on, and
+ *   those of the response.
+ * returns the HTTP status code, or -1 if the transfer failed
+ */
+long download(CURL *curl, string const & url, string const & filename, int binary,
+              validators *v, transfer_stats *st, string *tmp)
+{
+	struct curl_slist *headers = NULL;
+	string part;
+	long status = -1;
+	curl_off_t body = 0;
+	long head = 0;
+	CURLcode rc;
+	FILE *file = NULL;
+	csv_stream cs;
+	int fd;
+
+	part = make_tempfile(filename, &fd);
+	if (part.empty())
+		return -1;
+	if (binary) {
+		close(fd);  /* write_binary opens it again */
+	} else if (!(file = fdopen(fd, "w"))) {
+		perror("fdopen");
+		close(fd);
+		remove(part.c_str());
+		return -1;
+	}
+	struct stat sb;
+	if (stat(filename.c_str(), &sb) == -1) {
+		/* the validators are for a file we no longer have */
+		v->etag.clear();
+		v->last_modified.clear();
+	}
+	if (!v->etag.empty())
+		headers = curl_slist_append(headers, ("If-None-Match: " + v->etag).c_str());
+	if (!v->last_modified.empty())
+		headers = curl_slist_append(headers, ("If-Modified-Since: " + v->last_modified).c_str());
+	validators response;
+
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	if (binary) {
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback_parse);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &cs);
+	} else {
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback_fwrite);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
+	}
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_callback_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+	rc = curl_easy_perform(curl);
+	if (file && fclose(file) != 0 && rc == CURLE_OK) {
+		perror(part.c_str());
+		rc = CURLE_WRITE_ERROR;
+	}
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+	curl_slist_free_all(headers);
+
+	if (rc == CURLE_OK) {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+		curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &body);
+		curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &head);
+	} else {
+		fprintf(stderr, "%s: %s\n", basename_of(filename).c_str(), curl_easy_strerror(rc));
+	}
+	st->requests++;
+	st->bytes += body + head;
+	if (status == 200 && binary) {
+		if (csv_stream_finish(&cs) == -1) {
+			fprintf(stderr, "%s: no date and closing price columns\n", basename_of(filename).c_str());
+			status = -1;
+		} else if (write_binary(part, cs) == -1) {
+			status = -1;
+		}
+	}
+	if (status == 200) {
+		*v = response;
+		*tmp = part;
+		return status;
+	}
+	remove(part.c_str());
+	if (status == 304)
+		st->not_modified++;
+	return status;
+}
+
 void die(char const *fmt, ...)
 {
 	va_list args;
@@ -282,20 +771,295 @@ void die(char const *fmt, ...)
 	exit(1);
 }
 
+/*
+ * Columns of a Quandl bulk (WIKI_PRICES) file, used when the file has no
+ * header, and the names main expects for them in a per-ticker file.
+ */
+static char const *bulk_columns[][2] = {
+	{"ticker",      "Ticker"},
+	{"date",        "Date"},
+	{"open",        "Open"},
+	{"high",        "High"},
+	{"low",         "Low"},
+	{"close",       "Close"},
+	{"volume",      "Volume"},
+	{"ex-dividend", "Ex-Dividend"},
+	{"split_ratio", "Split Ratio"},
+	{"adj_open",    "Adj. Open"},
+	{"adj_high",    "Adj. High"},
+	{"adj_low",     "Adj. Low"},
+	{"adj_close",   "Adj. Close"},
+	{"adj_volume",  "Adj. Volume"},
+};
+
+/* a run of consecutive lines of one ticker in a bulk file, [begin, end) in bytes */
+struct bulk_run {
+	string ticker;
+	size_t begin, end;
+};
+
+/*
+ * bulk_import
+ *   split a bulk CSV file, with the rows of many tickers and a ticker column,
+ *   into one TICKER.begin.end.csv file per ticker in dbroot, keeping the rows
+ *   dated in [begin, end]. If 'only' is not empty, other tickers are skipped,
+ *   as are tickers with no rows in the window.
+ *   With 'binary', TICKER.begin.end.bin files are written instead.
+ *   Returns the files written, sorted by ticker, as pairs of their temporary
+ *   and real names, see commit_batch.
+ *
+ * The file is memory mapped and cut into one chunk per thread at line
+ * boundaries. Each thread scans its chunk for runs of lines with the same
+ * ticker; bulk files are sorted by ticker, so there are few of them. The runs
+ * are then gathered by ticker and the files written in parallel, copying each
+ * run without its ticker column.
+ */
+vector<pair<string, string> > bulk_import(char const *path, string const & dbroot,
+                                          string const & begin, string const & end,
+                                          set<string> const & only, int binary)
+{
+	int fd, nchunks, c, ticker_col, date_col, ncol;
+	struct stat sb;
+	char const *data, *p, *eol;
+	size_t size, body;
+	vector<string> header;
+	vector<size_t> cuts;
+	vector<vector<bulk_run> > runs;
+	map<string, vector<pair<size_t, size_t> > > bytick;
+	vector<pair<string, string> > files;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &sb) == -1) {
+		perror(path);
+		die("Failed to open bulk file %s\n", path);
+	}
+	size = sb.st_size;
+	if (size == 0)
+		die("Bulk file %s is empty\n", path);
+	data = (char const *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		die("Failed to map bulk file %s\n", path);
+	}
+	close(fd);
+	madvise((void *) data, size, MADV_SEQUENTIAL);
+
+	/* the header, if there is one, tells us where the ticker and date are */
+	eol = (char const *) memchr(data, '\n', size);
+	eol = eol ? eol : data + size;
+	header = split_fields(data, (eol > data && eol[-1] == '\r') ? eol - 1 : eol);
+	ticker_col = date_col = -1;
+	for (c = 0; c < (int) header.size(); c++) {
+		strip(&header[c]);
+		if (strcasecmp(header[c].c_str(), "ticker") == 0)
+			ticker_col = c;
+		if (strcasecmp(header[c].c_str(), "date") == 0)
+			date_col = c;
+	}
+	if (date_col == -1) {  /* no header */
+		header.clear();
+		for (auto const & col : bulk_columns)
+			header.emplace_back(col[0]);
+		ticker_col = 0;
+		date_col = 1;
+		body = 0;
+	} else {
+		body = eol - data + 1;
+	}
+	if (ticker_col == -1)
+		die("Bulk file %s has no ticker column\n", path);
+	ncol = header.size();
+
+	/* cut the body into chunks at line boundaries */
+	nchunks = 1;
+#pragma omp parallel
+#pragma omp single
+	nchunks = omp_get_num_threads() * 4;
+	cuts.push_back(min(body, size));
+	for (c = 1; c < nchunks; c++) {
+		size_t at = body + (size - body) / nchunks * c;
+		p = (char const *) memchr(data + max(at, cuts.back()), '\n', size - max(at, cuts.back()));
+		cuts.push_back(p ? p - data + 1 : size);
+	}
+	cuts.push_back(size);
+	runs.resize(nchunks);
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (c = 0; c < nchunks; c++) {
+		char const *line = data + cuts[c];
+		char const *stop = data + cuts[c + 1];
+		while (line < stop) {
+			char const *nl = (char const *) memchr(line, '\n', stop - line);
+			nl = nl ? nl : stop;
+			/* find the ticker field */
+			char const *f = line;
+			int k;
+			for (k = 0; k < ticker_col && f < nl; k++) {
+				f = (char const *) memchr(f, ',', nl - f);
+				f = f ? f + 1 : nl;
+			}
+			char const *fend = (char const *) memchr(f, ',', nl - f);
+			fend = fend ? fend : nl;
+			if (f < nl) {
+				auto & r = runs[c];
+				size_t b = line - data;
+				/* runs are keyed by the upper case ticker, so compare without case */
+				if (!r.empty() && r.back().end == b &&
+				    r.back().ticker.size() == (size_t) (fend - f) &&
+				    strncasecmp(r.back().ticker.c_str(), f, fend - f) == 0) {
+					r.back().end = nl - data + (nl < stop);
+				} else {
+					r.push_back({upper(string(f, fend).c_str()), b, (size_t) (nl - data + (nl < stop))});
+				}
+			}
+			line = nl + 1;
+		}
+	}
+	for (auto const & r : runs) {
+		for (auto const & run : r) {
+			if (!only.empty() && only.count(run.ticker) == 0)
+				continue;
+			bytick[run.ticker].emplace_back(run.begin, run.end);
+		}
+	}
+
+	/* the per-ticker header, in the column names main expects */
+	string out_header;
+	for (c = 0; c < ncol; c++) {
+		if (c == ticker_col)
+			continue;
+		string name = header[c];
+		for (auto const & col : bulk_columns)
+			if (strcasecmp(name.c_str(), col[0]) == 0)
+				name = col[1];
+		if (!out_header.empty())
+			out_header.push_back(',');
+		out_header.append(name);
+	}
+	out_header.push_back('\n');
+
+	vector<pair<string, vector<pair<size_t, size_t> > > > todo(bytick.begin(), bytick.end());
+	files.resize(todo.size());
+#pragma omp parallel for schedule(dynamic, 1)
+	for (c = 0; c < (int) todo.size(); c++) {
+		string const & ticker = todo[c].first;
+		string out = out_header;
+		size_t nrows = 0;
+		for (auto const & range : todo[c].second) {
+			char const *line = data + range.first;
+			char const *stop = data + range.second;
+			while (line < stop) {
+				char const *nl = (char const *) memchr(line, '\n', stop - line);
+				nl = nl ? nl : stop;
+				vector<string> fields = split_fields(line, (nl > line && nl[-1] == '\r') ? nl - 1 : nl);
+				line = nl + 1;
+				if ((int) fields.size() <= max(ticker_col, date_col))
+					continue;
+				if (fields[date_col] < begin || fields[date_col] > end)
+					continue;
+				for (int k = 0, first = 1; k < (int) fields.size(); k++) {
+					if (k == ticker_col)
+						continue;
+					if (!first)
+						out.push_back(',');
+					out.append(fields[k]);
+					first = 0;
+				}
+				out.push_back('\n');
+				nrows++;
+			}
+		}
+		/* a file of just the header would be taken for the ticker's data by has_data */
+		if (nrows == 0)
+			continue;
+		string filename = make_filename(dbroot, ticker, begin.c_str(), end.c_str(), binary ? ".bin" : ".csv");
+		int fd;
+		string part = make_tempfile(filename, &fd);
+		if (part.empty())
+			continue;
+		if (binary) {
+			csv_stream cs;
+			close(fd);
+			csv_stream_feed(&cs, out.data(), out.size());
+			if (csv_stream_finish(&cs) == -1 || write_binary(part, cs) == -1) {
+				remove(part.c_str());
+				continue;
+			}
+		} else {
+			FILE *file = fdopen(fd, "w");
+			int ok = file && fwrite(out.data(), 1, out.size(), file) == out.size();
+			if ((file ? fclose(file) : close(fd)) != 0 || !ok) {
+				perror(part.c_str());
+				remove(part.c_str());
+				continue;
+			}
+		}
+		files[c] = make_pair(part, filename);
+	}
+	munmap((void *) data, size);
+	files.erase(remove(files.begin(), files.end(), pair<string, string>()), files.end());
+	return files;
+}
+
+/*
+ * read_tickers
+ *   append the tickers listed in 'path' ("-" for stdin) to *tickers. They are
+ *   separated by whitespace or commas, and '#' starts a comment.
+ */
+void read_tickers(char const *path, vector<string> *tickers)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t cap = 0;
+
+	file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	if (!file) {
+		perror(path);
+		die("Failed to read the ticker list\n");
+	}
+	while (getline(&line, &cap, file) != -1) {
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		for (char *tok = strtok(line, " \t\r\n,"); tok; tok = strtok(NULL, " \t\r\n,"))
+			tickers->push_back(upper(tok));
+	}
+	free(line);
+	if (file != stdin)
+		fclose(file);
+}
+
 void usage(char const *argv0)
 {
 	printf(
-	"Usage: %s [-h|--help] [-k FILE] [-b DATE] [-e DATE] [-o DIR] -- [TICKER...]\n"
+	"Usage: %s [-h|--help] [-f] [-B] [-u URL] [-l FILE] [-k FILE] [-b DATE] [-e DATE] [-o DIR] -- [TICKER...]\n"
+	"       %s [-h|--help] [-B] [-l FILE] -i FILE|URL [-b DATE] [-e DATE] [-o DIR] -- [TICKER...]\n"
 	"    -h,--help             show this help message\n"
 	"    -k                    file containing a Quandl api key (required)\n"
 	"    -b                    Beginning date, YYYY-mm-dd\n"
 	"    -e                    Ending date, YYYY-mm-dd\n"
 	"    -o                    Output directory. If this is omitted\n"
 	"                          default behavior is to print to stdout\n"
+	"    -f                    Refresh: check files which are already in the output\n"
+	"                          directory with the server, and download them again if\n"
+	"                          the data has changed\n"
+	"    -B                    Binary: parse the data as it is downloaded, and save the\n"
+	"                          dates and closing prices as TICKER.begin.end.bin, which\n"
+	"                          main reads without parsing\n"
+	"    -u                    Base URL of the data server (default %s)\n"
+	"    -i                    Import: split a bulk file of many tickers, with a ticker\n"
+	"                          column, into one file per ticker in the output directory.\n"
+	"                          With TICKERs, only those are kept\n"
+	"    -l                    File listing more TICKERs, separated by whitespace or\n"
+	"                          commas (- for stdin). '#' starts a comment. Duplicates\n"
+	"                          are only fetched once\n"
 	"    TICKER...             One or more stock symbols.\n"
 	"\n"
-	"    All of the arguments are required\n"
-	,argv0);
+	"    -k, -b, -e, -o and at least one TICKER are required, except that\n"
+	"    imports do not need -k or TICKERs\n"
+	,argv0
+	,argv0
+	,urlbase.c_str());
 	exit(1);
 }
 
@@ -313,10 +1077,24 @@ int main(int argc, char **argv)
 	string begin;         /* beginning and ending dates */
 	string end;
 	string dbroot;        /* root directory of the database (passed by the user via [-o] option) */
-	vector<string> dbfiles;     /* all .csv files found in dbroot */
+	catalog dbfiles;      /* all .csv and .bin files found in dbroot, by ticker */
+	vector<string> tickers;     /* from the command line and -l, without duplicates */
+	vector<string> listed;      /* from -l */
+	set<string> seen;
 	int ac;
 	char **av;
 	string buffer;        /* memory buffer containing the stock data */
+	int refresh;          /* revalidate files we already have */
+	string import;        /* bulk file or URL to split into per-ticker files */
+	int binary;           /* write binary files instead of CSV */
+	char const *ext;
+	commit_batch batch;   /* downloaded files waiting to be synced and moved into place */
+	map<string, validators> vs;  /* validators of the files in dbroot, by file name */
+	transfer_stats st;
+
+	refresh = 0;
+	binary = 0;
+	memset(&st, 0, sizeof st);
 
 	/* parsing command line options */
 	for (ac = argc - 1, av = argv + 1;
@@ -349,6 +1127,29 @@ int main(int argc, char **argv)
 				dbroot = tmp;
 				brk_ = 1;
 				break;
+			case 'f':
+				refresh = 1;
+				break;
+			case 'B':
+				binary = 1;
+				break;
+			case 'i':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				import = tmp;
+				brk_ = 1;
+				break;
+			case 'l':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				read_tickers(tmp, &listed);
+				brk_ = 1;
+				break;
+			case 'u':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				urlbase = tmp;
+				if (urlbase.back() != '/')
+					urlbase.push_back('/');
+				brk_ = 1;
+				break;
 			case 'h':
 				usage(argv0);
 			default:
@@ -356,21 +1157,27 @@ int main(int argc, char **argv)
 			}
 		}
 	}
-	if (!ac) {
+	for ( ; ac && *av; ac--, av++)
+		listed.push_back(upper(*av));
+	for (auto & t : listed) {
+		if (seen.insert(t).second)
+			tickers.push_back(t);
+	}
+	if (tickers.empty() && import.empty()) {
 		die("Must specify at least one stock symbol\n");
 	}
 	if (begin.empty() || end.empty()) {
 		die("Must specify begin and end dates\n");
 	}
-	if (api_key_file.empty()) {
-		die("API Key file missing\n");
-	}
-
-	api_key = slurp(api_key_file);
-	strip(&api_key);
-
-	if (api_key.empty()) {
-		die("Failed to read api key from file: %s\n", api_key_file.c_str());
+	if (import.empty()) {
+		if (api_key_file.empty()) {
+			die("API Key file missing\n");
+		}
+		api_key = slurp(api_key_file);
+		strip(&api_key);
+		if (api_key.empty()) {
+			die("Failed to read api key from file: %s\n", api_key_file.c_str());
+		}
 	}
 	if (dbroot.empty()) {
 		die("Database root is required\n");
@@ -388,39 +1195,109 @@ int main(int argc, char **argv)
 		perror("database_init:");
 		die("Failed to initialize the database\nAborting\n");
 	}
+	mode_t mask = umask(0);
+	umask(mask);
+	file_mode = 0666 & ~mask;
 	dbfiles = get_db_files(dbroot);
+	vs = load_validators(dbroot);
+	batch.dirfd = open(dbroot.c_str(), O_RDONLY | O_DIRECTORY);
+	if (batch.dirfd == -1) {
+		perror(dbroot.c_str());
+		die("Failed to open the database\n");
+	}
+	ext = binary ? ".bin" : ".csv";
 
 	printf("%s\n%s\n", begin.c_str(), end.c_str());
 	curl = curl_easy_init();
-	for ( ; ac && *av; ac--, av++) {
-		auto ticker = upper(*av);
-		auto found = find_file_by_ticker(ticker, dbfiles);
+	/* one handle for every request, so that its connections are reused. Keepalive
+	 * probes just stop an idle connection from being dropped between requests */
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	if (!import.empty()) {
+		set<string> only(tickers.begin(), tickers.end());  /* tickers to keep, or all of them if empty */
+		string path = import;
+		tickers.clear();  /* they select from the import, and are not downloaded */
+		if (import.compare(0, 7, "http://") == 0 || import.compare(0, 8, "https://") == 0) {
+			/* keep the download, so that the next import can be a conditional request */
+			path = dbroot + "/.bulk";
+			string tmp;
+			long status = download(curl, import, path, 0, &vs[".bulk"], &st, &tmp);
+			if (status != 200 && status != 304) {
+				die("Failed to download %s (HTTP status %ld)\n", import.c_str(), status);
+			}
+			if (status == 200) {
+				batch.renames.emplace_back(tmp, path);
+				batch_commit(&batch);
+			}
+		}
+		auto files = bulk_import(path.c_str(), dbroot, begin, end, only, binary);
+		for (auto const & f : files) {
+			/* replace any file we had for the ticker over other dates */
+			string name = basename_of(f.second);
+			for (auto const & old : dbfiles[name.substr(0, name.find('.'))]) {
+				string oldname = basename_of(old);
+				if (oldname != name) {
+					batch.obsolete.push_back(old);
+					vs.erase(oldname);
+				}
+			}
+			vs.erase(name);
+			batch_add(&batch, f.first, f.second);
+		}
+	}
+	for (auto const & ticker : tickers) {
+		auto found = find_file_by_ticker(ticker, dbfiles, ext);
 		string filename;
-		FILE *file;
-		if (found != dbfiles.end()) {
+		string url;
+		int cached = 0;   /* we have a good file already, and are only refreshing it */
+		string obsolete;  /* a file for other dates, to remove once we have the new one */
+		string tmp;
+		if (found) {
 			filename = *found;
 			if (has_data(filename, begin.c_str(), end.c_str())) {
-				printf("%s\n", filename.c_str());
-				continue;
-			} else { /* remove this file, replace it with the new one */
-				remove(filename.c_str());
-				*found = filename = make_filename(dbroot, ticker, begin.c_str(), end.c_str());
+				if (!refresh) {
+					batch.output.push_back(filename);
+					continue;
+				}
+				/* ask for the same dates again, conditional on the validators we have */
+				string fbegin, fend;
+				dates_from_filename(filename, &fbegin, &fend);
+				url = make_url(ticker, api_key, fbegin.c_str(), fend.c_str());
+				cached = 1;
+			} else { /* replace this file with the new one, once that is safely on disk */
+				obsolete = filename;
+				vs.erase(basename_of(filename));
+				*found = filename = make_filename(dbroot, ticker, begin.c_str(), end.c_str(), ext);
 			}
 		} else {
-			filename = make_filename(dbroot, ticker, begin.c_str(), end.c_str());
+			filename = make_filename(dbroot, ticker, begin.c_str(), end.c_str(), ext);
 		}
-		file = fopen(filename.c_str(), "w");
-		auto url = make_url(ticker, api_key, begin.c_str(), end.c_str());
-		char const *urlc = url.c_str();
+		if (url.empty())
+			url = make_url(ticker, api_key, begin.c_str(), end.c_str());
 
-		curl_easy_setopt(curl, CURLOPT_URL, urlc);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback_fwrite);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
-		curl_easy_perform(curl);
-		fclose(file);
-		printf("%s\n", filename.c_str());
+		auto & v = vs[basename_of(filename)];
+		long status = download(curl, url, filename, binary, &v, &st, &tmp);
+		if (status != 200 && status != 304) {
+			fprintf(stderr, "Failed to download %s (HTTP status %ld)\n", ticker.c_str(), status);
+			if (!cached) {
+				vs.erase(basename_of(filename));
+				continue;
+			}
+		}
+		if (!obsolete.empty())
+			batch.obsolete.push_back(obsolete);
+		if (status == 200)
+			batch_add(&batch, tmp, filename);
+		else
+			batch.output.push_back(filename);
 	}
 	curl_easy_cleanup(curl);
+	save_validators(dbroot, vs, &batch);
+	batch_commit(&batch);
+	close(batch.dirfd);
+	if (st.requests) {
+		fprintf(stderr, "%ld requests, %ld not modified, %ld bytes received\n",
+		        st.requests, st.not_modified, (long) st.bytes);
+	}
 }
 
 /*
@@ -13,20 +13,45 @@
   #define _GNU_SOURCE
 #endif
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>   /* pthread_setaffinity_np */
+#include <sched.h>     /* sched_getaffinity */
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>      /* clock_gettime */
+
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* ftruncate, sysconf */
+#include <sys/mman.h>  /* mmap, madvise */
+#include <sys/stat.h>  /* fstat */
+#include <sys/inotify.h>
+#include <sys/wait.h>  /* waitpid */
 
 #include <map>
+#include <set>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <algorithm>/* stable_partition */
+#include <functional>  /* greater */
 #include <utility>  /* move */
 #include <random>   /* uniform_real_distribution */
 #include <mutex>    /* for threadsafe printf */
+#include <limits>   /* numeric_limits */
+
+#include <omp.h>
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
 
 #include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/Sparse>
+#include <Eigen/QR>
+#include <Eigen/Eigenvalues>
 
 using namespace std;
 using namespace Eigen;
@@ -38,6 +63,9 @@ using namespace Eigen;
 #define DATE_FMT "%Y-%m-%d"
 #define DATE_KEY "Date"
 #define DATA_SEP ','
+/* binary price files written by getstock -B, see read_binary */
+#define BINARY_MAGIC "M4300BN1"
+#define NS_PER_SEC 1000000000LL
 
 /* advance 'ptr' to the 'count' field in a CSV line */
 #define ADVANCE(ptr, count) \
@@ -56,17 +84,76 @@ do { \
 #define DEFAULT_MIN_RETURN 0.002
 #define DEFAULT_TCOST 10.0
 #define SECONDS_IN_DAY 86400
+#define DEFAULT_GLASSO_LAMBDA 0.1
+#define PAIRWISE_FILL_THRESHOLD 0.9   /* see cov_pairwise */
+#define PAIRWISE_TILE 64   /* columns per tile of cov_pairwise and cov_hy */
+#define GLASSO_PATH_LENGTH 8   /* number of warm started penalties leading up to lambda */
+#define GLASSO_SWEEP_BLOCK 128  /* coordinates of a lasso sweep between updates of W * b, see glasso_block */
+#define GLASSO_PAR_MIN 512      /* smallest component whose updates of W * b are split over threads */
+#define OOC_TILE_BYTES (64 << 20)   /* size of the tiles of an out of core covariance */
+#define OOC_FACTORS 20              /* factors kept from an out of core covariance */
+#define OOC_OVERSAMPLE 10
+#define OOC_ITERATIONS 4
+#define WATCH_THRESHOLD 0.01   /* smallest change in a weight worth reporting in watch mode */
+#define STREAM_MIN_DELTA 0.0005  /* smallest change in a weight printed in stream mode */
+#define STREAM_MAXIT 500         /* projected gradient iterations per bar, at most */
+#define STREAM_TOL 1e-8
+#define STREAM_MAXBACKOFF 64    /* doublings of the step size estimate per iteration, at most */
+#define HUGE_PAGE_SIZE (2 << 20)
+#define BL_TAU 0.05     /* Black-Litterman: uncertainty of the equilibrium returns, relative to C */
+#define BL_DELTA 2.5    /* Black-Litterman: risk aversion of the market */
+#define DEFAULT_KAPPA 1.0   /* robust mode: size of the uncertainty set, in standard errors */
+#define KELLY_BLOCK 256         /* scenarios per rank-k update of the Kelly Hessian */
+#define KELLY_TOL 1e-10
+#define KELLY_MIN_WEIGHT 1e-6   /* smaller Kelly weights are barrier noise, and not printed */
+#define SIM_STEPS 52      /* returns per simulated path: a year of weekly returns */
+#define SIM_BLOCK 4       /* length of the blocks of returns resampled by -g bootstrap */
+#define SIM_CHUNK 1024    /* paths simulated together by one thread */
+#define SIM_SEED 4300
+#define FRONTIER_BLOCK 4096   /* samples swept together by frontier_merge */
+#define BATCH_HEAD 4          /* doubles before the weights in a record of batch_solve */
+#define MAX_PERIOD_RETURNS (1LL << 28)   /* entries of the matrix of periodReturns (2 GB), at most */
+
+/* optimization modes, selected with -m */
+enum {
+	MODE_SAMPLE,   /* random portfolios, eliminating one stock at a time (default) */
+	MODE_GLASSO,   /* minimum variance from a sparse (graphical lasso) precision matrix */
+	MODE_HRP,      /* hierarchical risk parity */
+	MODE_TRACK,    /* minimum tracking error to a benchmark */
+	MODE_ROBUST,   /* minimum variance with a worst case expected return */
+	MODE_KELLY,    /* greatest average log growth */
+};
+
+/* covariance estimators for intraday data, selected with -e */
+enum {
+	EST_SAMPLE,    /* sample covariance of the returns over each period (default) */
+	EST_HY,        /* Hayashi-Yoshida realized covariance of the ticks, see cov_hy */
+};
+
+/* generators of returns for -M, selected with -g */
+enum {
+	SIM_NORMAL,    /* normal, with the mean and variance of the portfolio (default) */
+	SIM_BOOTSTRAP, /* blocks of the historical returns */
+};
 
 #define MAX(x, y) ((x) > (y)) ? (x) : (y)
 #define MIN(x, y) ((x) < (y)) ? (x) : (y)
 
+/* where die and warn write: stderr in the batch workers, whose stdout is
+ * thrown away, see batch_fork */
+static FILE *diagnostics = stdout;
+
 void die(char const *fmt, ...)
 {
 	va_list args;
 
 	va_start(args, fmt);
-	vfprintf(stdout, fmt, args);
+	vfprintf(diagnostics, fmt, args);
 	va_end(args);
+#ifdef USE_MPI
+	fflush(diagnostics);
+	MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
 	exit(1);
 }
 
@@ -75,7 +162,7 @@ void warn(char const *fmt, ...)
 	va_list args;
 
 	va_start(args, fmt);
-	vfprintf(stdout, fmt, args);
+	vfprintf(diagnostics, fmt, args);
 	va_end(args);
 }
 
@@ -88,6 +175,127 @@ typename Container::iterator index_remove(Iter ixbegin, Iter ixend, Container &
 	});
 }
 
+/*
+ * Low latency profile (-L). For runs with a deadline, the cost is in the tail:
+ * a thread migrated to another core loses its cache, and the first touch of a
+ * freshly allocated matrix is a page fault per 4K. So
+ *   - each OpenMP thread is pinned to a core of its own
+ *   - the program's memory is locked, and the big matrices are copied into
+ *     buffers backed by (transparent) huge pages, locked and so pre-faulted,
+ *     see lowlat_buffer
+ *   - the time of each step (an elimination step of the sampler, a bar in
+ *     stream mode, an update in watch mode) is recorded, and the median and
+ *     99th percentile are printed at exit
+ */
+static int lowlat;
+static vector<double> latencies;   /* seconds per step */
+static volatile sig_atomic_t interrupted;
+
+#ifdef USE_MPI
+static int mpi_rank, mpi_size;   /* see batch_mpi */
+
+static void mpi_finalize()
+{
+	MPI_Finalize();
+}
+#endif
+
+double lowlat_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* record the time since 'start', a lowlat_clock() */
+void lowlat_record(double start)
+{
+	if (lowlat)
+		latencies.push_back(lowlat_clock() - start);
+}
+
+void lowlat_report()
+{
+	size_t n = latencies.size();
+	if (n == 0)
+		return;
+	sort(latencies.begin(), latencies.end());
+	fprintf(stderr, "latency of %zu steps: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", n,
+	        1e3 * latencies[(n - 1) / 2], 1e3 * latencies[(n - 1) * 99 / 100], 1e3 * latencies[n - 1]);
+}
+
+static void lowlat_signal(int)
+{
+	interrupted = 1;
+}
+
+/* 'daemon' = a mode which runs until it is stopped, see lowlat_signal */
+void lowlat_init(int daemon)
+{
+	cpu_set_t allowed;
+	vector<int> cpus;
+	struct sigaction sa;
+
+	lowlat = 1;
+	latencies.reserve(1 << 16);
+	if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+		for (int c = 0; c < CPU_SETSIZE; c++)
+			if (CPU_ISSET(c, &allowed))
+				cpus.push_back(c);
+	}
+	/* OpenMP keeps the same threads from one parallel region to the next */
+	if (!cpus.empty()) {
+#pragma omp parallel
+		{
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &one);
+			pthread_setaffinity_np(pthread_self(), sizeof one, &one);
+		}
+	}
+	/* MCL_FUTURE, as the data is read (and the buffers reallocated as the
+	 * sampler shrinks them) after this. MCL_ONFAULT so that a new mapping is
+	 * locked as it is touched rather than faulted in by the allocation, which
+	 * would be before lowlat_buffer can ask for huge pages */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == -1
+	    && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		warn("mlockall: %s, memory will not be locked\n", strerror(errno));
+	/* so that modes which run until they are stopped can still report, the
+	 * signals interrupt their reads (no SA_RESTART) and they return */
+	if (daemon) {
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = lowlat_signal;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+	}
+	atexit(lowlat_report);
+}
+
+/*
+ * lowlat_buffer
+ *   in the low latency profile, move *m into memory backed by huge pages where
+ *   it is big enough, and lock it (which faults it all in now, not on first use)
+ */
+void lowlat_buffer(MatrixXd *m)
+{
+	static int warned;
+	size_t len;
+	uintptr_t b, e;
+
+	if (!lowlat || m->size() == 0)
+		return;
+	len = m->size() * sizeof(double);
+	MatrixXd tmp(m->rows(), m->cols());  /* not touched yet */
+	b = ((uintptr_t) tmp.data() + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+	e = ((uintptr_t) tmp.data() + len) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+	if (e > b)
+		madvise((void *) b, e - b, MADV_HUGEPAGE);
+	tmp = *m;   /* the first touch, which faults in the huge pages */
+	if (mlock(tmp.data(), len) == -1 && !warned++)
+		warn("mlock: %s, buffers will not be locked\n", strerror(errno));
+	m->swap(tmp);
+}
+
 string upper(char const *s)
 {
 	int size = (int) strlen(s);
@@ -101,15 +309,19 @@ string upper(char const *s)
 
 /*
  * Given a filename of the form
- * TICKER.begin.end.csv
+ * [dir/]TICKER.begin.end.csv
  * return TICKER
  */
 string ticker_from_filename(char const *filename)
 {
 	char buf[256];
 	char *pd;
+	char const *slash;
 
-	strcpy(buf, filename);
+	slash = strrchr(filename, '/');
+	if (slash)
+		filename = slash + 1;
+	snprintf(buf, sizeof buf, "%s", filename);
 	pd = strchrnul(buf, '.');
 	*pd = '\0';
 	return upper(buf);
@@ -178,6 +390,116 @@ void timetostr(time_t t, char *s)
 	strftime(s,64,"%Y-%m-%d",tm);
 }
 
+/*
+ * Intraday timestamps: nanoseconds since 1970-01-01 00:00:00 UTC.
+ * 64 bits of nanoseconds cover the years 1678 to 2262.
+ */
+typedef int64_t timestamp;
+
+/* days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static int64_t days_from_civil(int64_t y, int m, int d)
+{
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/* parse exactly 'n' digits at *s, advancing *s. returns -1 if they are not digits */
+static inline int parse_digits(char const **s, char const *e, int n)
+{
+	int v = 0;
+	if (e - *s < n)
+		return -1;
+	for (int i = 0; i < n; i++) {
+		unsigned c = (unsigned) (*s)[i] - '0';
+		if (c > 9)
+			return -1;
+		v = 10 * v + c;
+	}
+	*s += n;
+	return v;
+}
+
+/*
+ * parse_timestamp
+ *   parse the timestamp in [s, e), one of
+ *     YYYY-mm-dd
+ *     YYYY-mm-dd HH:MM[:SS[.fraction]][Z]    ('T' may separate date and time)
+ *     an integer number of nanoseconds since the epoch
+ *   all in UTC. This is a hand written parser, because strptime and mktime are
+ *   far too slow for millions of rows.
+ *   returns the time, and sets *endp to the end of the text used, or to s on error.
+ */
+timestamp parse_timestamp(char const *s, char const *e, char const **endp)
+{
+	char const *p = s;
+	int y, mo, d, h = 0, mi = 0, sec = 0;
+	int64_t frac = 0;
+
+	*endp = s;
+	if (e - s < 10 || s[4] != '-') {  /* epoch nanoseconds */
+		int64_t ns = 0;
+		for ( ; p < e && (unsigned) (*p - '0') <= 9; p++)
+			ns = 10 * ns + (*p - '0');
+		if (p != s)
+			*endp = p;
+		return ns;
+	}
+	if ((y = parse_digits(&p, e, 4)) < 0 || *p++ != '-' ||
+	    (mo = parse_digits(&p, e, 2)) < 0 || *p++ != '-' ||
+	    (d = parse_digits(&p, e, 2)) < 0)
+		return 0;
+	if (p + 1 < e && (*p == 'T' || *p == ' ') && (unsigned) (p[1] - '0') <= 9) {
+		p++;
+		if ((h = parse_digits(&p, e, 2)) < 0 || p == e || *p++ != ':' ||
+		    (mi = parse_digits(&p, e, 2)) < 0)
+			return 0;
+		if (p < e && *p == ':') {
+			p++;
+			if ((sec = parse_digits(&p, e, 2)) < 0)
+				return 0;
+			if (p < e && *p == '.') {
+				int64_t scale = NS_PER_SEC;
+				for (p++; p < e && (unsigned) (*p - '0') <= 9; p++) {
+					if (scale > 1) {
+						scale /= 10;
+						frac += scale * (*p - '0');
+					}
+				}
+			}
+		}
+		if (p < e && *p == 'Z')
+			p++;
+	}
+	*endp = p;
+	return ((days_from_civil(y, mo, d) * 24 + h) * 60 * 60 + mi * 60 + sec) * NS_PER_SEC + frac;
+}
+
+/*
+ * parse_period
+ *   parse a length of time such as 30s, 5m, 1h, 1d or 250ms (ns and us too),
+ *   in seconds if there is no unit. returns it in nanoseconds, or 0 on error.
+ */
+timestamp parse_period(char const *s)
+{
+	static struct { char const *unit; timestamp ns; } const units[] = {
+		{ "ns", 1 }, { "us", 1000 }, { "ms", 1000000 }, { "s", NS_PER_SEC }, { "", NS_PER_SEC },
+		{ "m", 60 * NS_PER_SEC }, { "h", 3600 * NS_PER_SEC }, { "d", 86400 * NS_PER_SEC },
+	};
+	char *endptr;
+	double v = strtod(s, &endptr);
+	if (endptr == s || v <= 0.0)
+		return 0;
+	for (auto const & u : units) {
+		if (strcmp(endptr, u.unit) == 0)
+			return (timestamp) (v * u.ns);
+	}
+	return 0;
+}
+
 /*
  * read_until
  * read from 'file' until time 'begin' is reached
@@ -218,7 +540,7 @@ time_t read_until(FILE *file, time_t begin, int date_index)
 			/* the datetime for this line in the file is >= the specified start datetime.
 			 * rewind the file pointer so the caller can re-read this line after this call returns.
 			 */
-			fseek(file, SEEK_CUR, -nread);
+			fseek(file, -nread, SEEK_CUR);
 			return tmp;
 		}
 	}
@@ -227,12 +549,56 @@ time_t read_until(FILE *file, time_t begin, int date_index)
 	return 0;
 }
 
+/* does 'filename' end in ".bin" (a binary price file, see read_binary) */
+int is_binary(char const *filename)
+{
+	size_t len = strlen(filename);
+	return len >= 4 && strcmp(filename + len - 4, ".bin") == 0;
+}
+
+/*
+ * read_binary
+ *   read the dates and closing prices from a binary price file, as written
+ *   by getstock -B:
+ *     char     magic[8]     BINARY_MAGIC
+ *     uint64_t n            number of rows
+ *     int64_t  dates[n]     Unix time of the date, as strtotime gives
+ *     double   closes[n]
+ *   returns 0 on success, or -1 if the file could not be read
+ */
+int read_binary(char const *filename, vector<time_t> *dates, vector<double> *closes)
+{
+	char magic[8];
+	uint64_t n;
+	vector<int64_t> d;
+	FILE *file;
+	int ok;
+
+	file = fopen(filename, "r");
+	if (!file)
+		return -1;
+	ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, BINARY_MAGIC, 8) == 0 &&
+	     fread(&n, sizeof n, 1, file) == 1;
+	if (ok) {
+		d.resize(n);
+		closes->resize(n);
+		ok = fread(d.data(), sizeof(int64_t), n, file) == n &&
+		     fread(closes->data(), sizeof(double), n, file) == n;
+	}
+	fclose(file);
+	if (!ok)
+		return -1;
+	dates->assign(d.begin(), d.end());
+	return 0;
+}
+
 /*
- * read_stock_data
- *   return a map of ticker -> prices
+ * load_stock_data
+ *   read_stock_data into *out, but return -1 rather than exit if a file
+ *   can not be read, for the batch (-B) where that fails one scenario only
  */
-map<string, vector<double> >
-read_stock_data(vector<string> & filepaths, time_t start, time_t end)
+int load_stock_data(vector<string> & filepaths, time_t start, time_t end,
+                    map<string, vector<double> > *out)
 {
 	/* it could be the case that the dates in the file do not match up.
 	 * We synchronize the dates by first getting the latest available starting
@@ -240,7 +606,7 @@ read_stock_data(vector<string> & filepaths, time_t start, time_t end)
 	 * So when we read from the files and save data in some arrays, the dates will
 	 * all be sync'd up by index (assuming there are no missing rows in the data)
 	 */
-	map<string, vector<double> > data;
+	map<string, vector<double> > & data = *out;
 	vector<double> prices;         /* temp variable */
 	char buf[256];
 	char *p; /* position in a line of the CSV file */
@@ -248,10 +614,32 @@ read_stock_data(vector<string> & filepaths, time_t start, time_t end)
 
 	for (int i = 0; i < (int) filepaths.size(); i++) {
 		char const *f = filepaths[i].c_str();
+		if (is_binary(f)) {
+			vector<time_t> dates;
+			vector<double> closes;
+			if (read_binary(f, &dates, &closes) == -1) {
+				perror("read_binary:");
+				warn("Failed to read file %s\n", f);
+				return -1;
+			}
+			for (int k = 0; k < (int) dates.size() && dates[k] <= end; k++) {
+				if (dates[k] >= start)
+					prices.push_back(closes[k]);
+			}
+			if (prices.empty()) {
+				warn("Data has no observations >= start date: %s\n", f);
+				ixrm.push_back(i);
+				continue;
+			}
+			data[ticker_from_filename(f)] = prices;
+			prices.clear();
+			continue;
+		}
 		FILE *file = fopen(f, "r");
 		if (!file) {
 			perror("fopen:");
-			die("Failed to open file %s aborting\n", f);
+			warn("Failed to open file %s\n", f);
+			return -1;
 		}
 		auto ticker = ticker_from_filename(f);
 		/* get index of date, and Adj. Close */
@@ -294,8 +682,9 @@ read_stock_data(vector<string> & filepaths, time_t start, time_t end)
 			char *endptr;
 			double price = strtod(p, &endptr);
 			if (price == 0.0 && endptr == p) { /* a parse error ocurred */
-				perror("Parsing Adj. Close");
-				die("Aborting\n");
+				warn("Failed to parse the closing price in %s: %s", f, buf);
+				fclose(file);
+				return -1;
 			}
 			prices.push_back(price);
 		}
@@ -321,20 +710,318 @@ read_stock_data(vector<string> & filepaths, time_t start, time_t end)
 			it++;
 		}
 	}
+	return 0;
+}
+
+/*
+ * read_stock_data
+ *   return a map of ticker -> prices
+ */
+map<string, vector<double> >
+read_stock_data(vector<string> & filepaths, time_t start, time_t end)
+{
+	map<string, vector<double> > data;
+
+	if (load_stock_data(filepaths, start, end, &data) == -1)
+		die("Aborting\n");
 	return data;
 }
 
+/*
+ * A panel of closing prices over the union of the dates found in the files.
+ * Unlike read_stock_data, tickers do not need to cover the whole window:
+ * names that were listed or delisted part way through keep the dates they
+ * were trading on. Each ticker has a validity interval [first, last] of
+ * indices into 'dates', and 'active' marks the dates on which it had a price.
+ */
+typedef Matrix<bool, Dynamic, Dynamic> MatrixXb;
+
+struct panel {
+	vector<time_t> dates;    /* sorted, one row per date */
+	vector<string> tickers;  /* one column per ticker */
+	MatrixXd prices;         /* 0.0 where the ticker has no price */
+	MatrixXb active;
+	vector<int> first, last;
+};
+
+/*
+ * read_panel
+ *   read the closing prices in [start, end] from each file into a panel.
+ *   Unreadable files and rows are skipped with a warning.
+ */
+panel read_panel(vector<string> const & filepaths, time_t start, time_t end)
+{
+	map<string, vector<pair<time_t, double> > > series;
+	panel pn;
+	char buf[256];
+	char *p, *endptr;
+	int i, j;
+
+	for (i = 0; i < (int) filepaths.size(); i++) {
+		char const *f = filepaths[i].c_str();
+		auto ticker = ticker_from_filename(f);
+		if (is_binary(f)) {
+			vector<time_t> dates;
+			vector<double> closes;
+			if (read_binary(f, &dates, &closes) == -1) {
+				warn("Failed to read file %s, skipping\n", f);
+				continue;
+			}
+			auto & obs = series[ticker];
+			for (j = 0; j < (int) dates.size() && dates[j] <= end; j++) {
+				if (dates[j] >= start && closes[j] > 0.0)
+					obs.emplace_back(dates[j], closes[j]);
+			}
+			if (obs.empty()) {
+				warn("Data has no observations in the window: %s\n", f);
+				series.erase(ticker);
+			}
+			continue;
+		}
+		FILE *file = fopen(f, "r");
+		if (!file) {
+			warn("Failed to open file %s, skipping\n", f);
+			continue;
+		}
+		if (!fgets(buf, sizeof buf, file)) {
+			warn("File %s is empty\n", f);
+			fclose(file);
+			continue;
+		}
+		int close_index = indexOf(buf, "Adj. Close");
+		if (close_index == -1)
+			close_index = indexOf(buf, "Close");
+		int date_index = indexOf(buf, "date");
+		if (close_index == -1 || date_index == -1) {
+			warn("Could not find date and closing price fields for: %s\n", ticker.c_str());
+			fclose(file);
+			continue;
+		}
+		auto & obs = series[ticker];
+		while (fgets(buf, sizeof buf, file)) {
+			p = buf;
+			ADVANCE(p, date_index);
+			if (!p)
+				continue;
+			time_t t = strtotime(p);
+			if (t < start)
+				continue;
+			if (t > end)
+				break;
+			p = buf;
+			ADVANCE(p, close_index);
+			if (!p)
+				continue;
+			double price = strtod(p, &endptr);
+			if (endptr == p || price <= 0.0) {
+				continue;  /* a gap, not an error */
+			}
+			obs.emplace_back(t, price);
+		}
+		fclose(file);
+		if (obs.empty()) {
+			warn("Data has no observations in the window: %s\n", f);
+			series.erase(ticker);
+		}
+	}
+
+	for (auto const & s : series)
+		for (auto const & o : s.second)
+			pn.dates.push_back(o.first);
+	sort(pn.dates.begin(), pn.dates.end());
+	pn.dates.erase(unique(pn.dates.begin(), pn.dates.end()), pn.dates.end());
+
+	pn.prices = MatrixXd::Zero(pn.dates.size(), series.size());
+	pn.active = MatrixXb::Constant(pn.dates.size(), series.size(), false);
+	j = 0;
+	for (auto const & s : series) {
+		pn.tickers.push_back(s.first);
+		for (auto const & o : s.second) {
+			i = lower_bound(pn.dates.begin(), pn.dates.end(), o.first) - pn.dates.begin();
+			pn.prices(i, j) = o.second;
+			pn.active(i, j) = true;
+		}
+		pn.first.push_back(lower_bound(pn.dates.begin(), pn.dates.end(), s.second.front().first) - pn.dates.begin());
+		pn.last.push_back(lower_bound(pn.dates.begin(), pn.dates.end(), s.second.back().first) - pn.dates.begin());
+		j++;
+	}
+	return pn;
+}
+
+
+/* the ticks of one security: prices at (intraday) times, in time order */
+struct ticks {
+	vector<timestamp> t;
+	vector<double> p;
+};
+
+/* the start of field 'n' in the line [p, eol), or NULL */
+static char const *line_field(char const *p, char const *eol, int n)
+{
+	for ( ; n > 0 && p; n--) {
+		p = (char const *) memchr(p, DATA_SEP, eol - p);
+		if (p)
+			p++;
+	}
+	return p;
+}
+
+/*
+ * read_ticks
+ *   read the ticks in [start, end] from 'filename' into *tk. CSV files need a
+ *   Date, Timestamp or Time column in one of the forms parse_timestamp accepts,
+ *   and a closing price (Adj. Close, Close or Price). Binary files (see
+ *   read_binary) give one tick per row.
+ *   The file is mapped and parsed in place, which keeps files of millions of
+ *   rows cheap to load. Unparsable rows are skipped.
+ *   returns 0 on success, or -1 if the file could not be read
+ */
+int read_ticks(char const *filename, timestamp start, timestamp end, ticks *tk)
+{
+	struct stat st;
+	char const *data, *p, *stop;
+	int fd;
+
+	tk->t.clear();
+	tk->p.clear();
+	if (is_binary(filename)) {
+		vector<time_t> dates;
+		vector<double> closes;
+		if (read_binary(filename, &dates, &closes) == -1)
+			return -1;
+		for (size_t k = 0; k < dates.size(); k++) {
+			/* the dates are local midnights (see strtotime), the ticks
+			 * UTC: keep the date, as parse_timestamp would read it */
+			struct tm tm;
+			localtime_r(&dates[k], &tm);
+			timestamp t = days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) *
+			              SECONDS_IN_DAY * NS_PER_SEC;
+			if (t >= start && t <= end && closes[k] > 0.0) {
+				tk->t.push_back(t);
+				tk->p.push_back(closes[k]);
+			}
+		}
+		return 0;
+	}
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	data = (char const *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+	stop = data + st.st_size;
+
+	p = (char const *) memchr(data, '\n', stop - data);
+	string header(data, p ? p : stop);
+	while (!header.empty() && isspace(header.back()))
+		header.pop_back();
+	int close_index = indexOf(header.c_str(), "Adj. Close");
+	if (close_index == -1)
+		close_index = indexOf(header.c_str(), "Close");
+	if (close_index == -1)
+		close_index = indexOf(header.c_str(), "Price");
+	int time_index = indexOf(header.c_str(), "Date");
+	if (time_index == -1)
+		time_index = indexOf(header.c_str(), "Timestamp");
+	if (time_index == -1)
+		time_index = indexOf(header.c_str(), "Time");
+	if (close_index == -1 || time_index == -1) {
+		munmap((void *) data, st.st_size);
+		return -1;
+	}
+
+	tk->t.reserve(st.st_size / 32);
+	tk->p.reserve(st.st_size / 32);
+	while (p && p < stop) {
+		char const *line = p + 1;
+		char const *eol = (char const *) memchr(line, '\n', stop - line);
+		if (!eol)
+			eol = stop;
+		p = eol;
+		char const *f = line_field(line, eol, time_index);
+		char const *fend;
+		if (!f)
+			continue;
+		timestamp t = parse_timestamp(f, eol, &fend);
+		if (fend == f || t < start || t > end)
+			continue;
+		f = line_field(line, eol, close_index);
+		if (!f)
+			continue;
+		char buf[64];  /* strtod needs a terminated string, and the map is not one */
+		size_t len = min((size_t) (eol - f), sizeof buf - 1);
+		memcpy(buf, f, len);
+		buf[len] = '\0';
+		char *endptr;
+		double price = strtod(buf, &endptr);
+		if (endptr == buf || price <= 0.0)
+			continue;
+		tk->t.push_back(t);
+		tk->p.push_back(price);
+	}
+	munmap((void *) data, st.st_size);
+
+	/* rows are normally in time order already */
+	if (!is_sorted(tk->t.begin(), tk->t.end())) {
+		vector<size_t> ix(tk->t.size());
+		for (size_t k = 0; k < ix.size(); k++)
+			ix[k] = k;
+		stable_sort(ix.begin(), ix.end(), [&](size_t a, size_t b) { return tk->t[a] < tk->t[b]; });
+		ticks sorted;
+		for (size_t k : ix) {
+			sorted.t.push_back(tk->t[k]);
+			sorted.p.push_back(tk->p[k]);
+		}
+		*tk = move(sorted);
+	}
+	return 0;
+}
+
+/*
+ * read_intraday
+ *   return a map of ticker -> ticks in [start, end]. Files which cannot be
+ *   read or have no ticks in the window are left out with a warning.
+ */
+map<string, ticks> read_intraday(vector<string> const & filepaths, timestamp start, timestamp end)
+{
+	map<string, ticks> data;
+	vector<ticks> all(filepaths.size());
+	vector<int> ok(filepaths.size());
+	int i;
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (i = 0; i < (int) filepaths.size(); i++)
+		ok[i] = read_ticks(filepaths[i].c_str(), start, end, &all[i]) == 0;
+	for (i = 0; i < (int) filepaths.size(); i++) {
+		char const *f = filepaths[i].c_str();
+		if (!ok[i]) {
+			warn("Failed to read file %s, skipping\n", f);
+		} else if (all[i].t.empty()) {
+			warn("Data has no observations in the window: %s\n", f);
+		} else {
+			data[ticker_from_filename(f)] = move(all[i]);
+		}
+	}
+	return data;
+}
 
 /*
  * Given a vector of prices for a given security
  * return the vector containing the weekly returns for that security
- * We compute weekly returns as:
- *    weeklyReturns = (p[i] - p[i-4]) / p[i-4],  4 <= i < n;
+ * We compute weekly returns over consecutive blocks of 5 days as:
+ *    weeklyReturns[i] = (p[5i+5] - p[5i]) / p[5i],  0 <= i < (n - 1) / 5;
  * which is the change over a 5 day period
- * ex: let i = 4, at index 4 we are at the 5th day
- *                at index i - 4 = 0 we are at the first day
- * so we can imagine this is the change from monday's closing price
- * to friday's closing price.
+ * ex: let i = 0, at index 5 we are at the 6th day
+ *                at index 0 we are at the first day
+ * so we can imagine this is the change from one friday's closing price
+ * to the next. The blocks are chained, each starting at the close the last
+ * ended on, so every daily move is in exactly one weekly return.
  */
 VectorXd weeklyReturns(vector<double> const & prices)
 {
@@ -342,13 +1029,111 @@ VectorXd weeklyReturns(vector<double> const & prices)
 	int i, n;
 
 	n = (int) prices.size();
-	returns.resize(n / 5);
+	returns.resize(max(0, (n - 1) / 5));
 	for (i = 0; i < returns.size(); i++) {
-		returns(i) = (prices[i+4] - prices[i]) / prices[i];
+		returns(i) = (prices[5*i+5] - prices[5*i]) / prices[5*i];
 	}
 	return returns;
 }
 
+/*
+ * stockReturns
+ *   the weekly returns of the prices of read_stock_data, one column per
+ *   stock, whose tickers are appended to 'tickers' in order
+ */
+MatrixXd stockReturns(map<string, vector<double> > const & data, vector<string> *tickers)
+{
+	MatrixXd R;
+	int nrow, colIndex;
+
+	nrow = (*data.begin()).second.size();  /* the number of prices we have for each stock */
+	R.resize(max(0, (nrow - 1) / 5), data.size());   /* divide by five b/c weekly returns... one column per stock */
+	colIndex = 0;
+	for (auto const & d : data) {
+		tickers->push_back(d.first);
+		R.col(colIndex++) = weeklyReturns(d.second);
+	}
+	return R;
+}
+
+/*
+ * panelReturns
+ *   weekly returns of every ticker in the panel, computed as in weeklyReturns
+ *   over chained blocks of 5 dates, [5i, 5i + 5], and only for the blocks
+ *   within the ticker's validity interval.
+ *   X = the returns, 0.0 where the return is missing
+ *   M = 1.0 where the return is present: the ticker is active on both days
+ */
+void panelReturns(panel const & pn, MatrixXd *X, MatrixXd *M)
+{
+	int nrow, ncol, i, j;
+
+	nrow = max(0, ((int) pn.dates.size() - 1) / 5);
+	ncol = pn.tickers.size();
+	*X = MatrixXd::Zero(nrow, ncol);
+	*M = MatrixXd::Zero(nrow, ncol);
+	for (j = 0; j < ncol; j++) {
+		/* blocks from the first which starts at or after 'first', to the
+		 * last which ends at or before 'last' */
+		int lo = (pn.first[j] + 4) / 5, hi = min(nrow, pn.last[j] / 5);
+		for (i = lo; i < hi; i++) {
+			if (pn.active(5 * i, j) && pn.active(5 * i + 5, j)) {
+				(*X)(i, j) = (pn.prices(5 * i + 5, j) - pn.prices(5 * i, j)) / pn.prices(5 * i, j);
+				(*M)(i, j) = 1.0;
+			}
+		}
+	}
+}
+
+/*
+ * periodReturns
+ *   returns of every series over consecutive periods of length 'period' (in
+ *   nanoseconds), one column per series in map order. The periods lie on a grid
+ *   over the window all the series cover, from the latest first tick to the
+ *   earliest last tick, so that no series has returns made up of a stale price.
+ *   The price at a grid point is that of the last tick at or before it
+ *   (previous tick).
+ *   Each series is walked once, so the cost is linear in the number of ticks.
+ */
+MatrixXd periodReturns(map<string, ticks> const & data, timestamp period)
+{
+	vector<ticks const *> series;
+	timestamp t0, t1, np;
+	int nper, j;
+	MatrixXd R;
+
+	t0 = numeric_limits<timestamp>::min();
+	t1 = numeric_limits<timestamp>::max();
+	for (auto const & d : data) {
+		series.push_back(&d.second);
+		t0 = max(t0, d.second.t.front());
+		t1 = min(t1, d.second.t.back());
+	}
+	np = (series.empty() || t1 <= t0) ? 0 : (t1 - t0) / period;
+	if (np > numeric_limits<int>::max() || np * (timestamp) series.size() > MAX_PERIOD_RETURNS)
+		die("%lld periods of %lld ns for %d series is too many, use a longer period\n",
+		    (long long) np, (long long) period, (int) series.size());
+	nper = (int) np;
+	R.resize(nper, series.size());
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (j = 0; j < (int) series.size(); j++) {
+		vector<timestamp> const & t = series[j]->t;
+		vector<double> const & p = series[j]->p;
+		size_t k = 0, n = t.size();
+		double last = 0.0;
+		for (int i = 0; i <= nper; i++) {
+			timestamp g = t0 + i * period;
+			while (k + 1 < n && t[k + 1] <= g)
+				k++;
+			if (i > 0)
+				R(i - 1, j) = (p[k] - last) / last;
+			last = p[k];
+		}
+	}
+	return R;
+}
+
 MatrixXd cov(MatrixXd const & m)
 {
 	/* please see https://stats.stackexchange.com/a/100948
@@ -399,183 +1184,3188 @@ MatrixXd cov(MatrixXd const & m)
 }
 
 
-/* thread safe printf and cout */
-void tsprintf(char const *fmt, ...)
+#ifdef USE_MPI
+/*
+ * cov_ring
+ *   cov(R) computed over the MPI ranks, for universes where one node cannot
+ *   stream the returns through its cores fast enough. R is on rank 0, and
+ *   the columns are scattered in one block per rank, which centers it.
+ *   Tile (i, j) of C is X_i' X_j / (T - 1). Rank r computes its diagonal
+ *   tile by a rank-k update (SYRK), then the blocks are passed around the
+ *   ring: at step s rank r holds block r - s and computes tile (r, r - s)
+ *   by GEMM. After P / 2 steps every tile has been computed once (at the
+ *   last step for an even P, only by the first half of the ranks, so only
+ *   they are sent a block), each rank having received just the blocks it
+ *   needed. The tiles are gathered on rank 0, which returns C; the other
+ *   ranks return an empty matrix.
+ */
+MatrixXd cov_ring(MatrixXd const & R)
 {
-	static mutex m;
-	lock_guard<mutex> lock(m);
-	va_list args;
-	va_start(args, fmt);
-	vfprintf(stdout, fmt, args);
-	va_end(args);
-}
+	long dims[2];
+	int T, n, P, r, nsteps;
+	vector<int> cols, first, counts, displs;
+	MatrixXd X, held, recv, C;
+	vector<double> tiles;
 
-template <typename T>
-ostream & tscout(T const & t)
-{
-	static mutex m;
-	lock_guard<mutex> lock(m);
-	cout << t << '\n';
-	return cout;
-}
+	P = mpi_size;
+	r = mpi_rank;
+	dims[0] = R.rows();
+	dims[1] = R.cols();
+	MPI_Bcast(dims, 2, MPI_LONG, 0, MPI_COMM_WORLD);
+	T = dims[0];
+	n = dims[1];
+	for (int q = 0, off = 0; q < P; q++) {
+		cols.push_back(n / P + (q < n % P));
+		first.push_back(off);
+		counts.push_back(T * cols[q]);
+		displs.push_back(T * off);
+		off += cols[q];
+	}
+	/* the tiles rank q computes: its diagonal, then (q, q - s) for s = 1 .. nsteps */
+	nsteps = P / 2;
+	auto computes = [&](int q, int s) { return s < P - s || q < P / 2; };
+	auto block = [&](int q, int s) { return ((q - s) % P + P) % P; };
 
-void usage(char const *argv0)
-{
-	printf(
-	"Usage: %s [-h|--help] [-c <float>] [-t <float>] [-r <float>]\n"
-	"    -h,--help           show this help message\n"
-	"    -c float            initial capital\n"
-	"    -t float            transaction cost per trade\n"
-	"    -r float            Minimum portfolio mean return, in percentage form (decimal)\n"
-	"\n"
-	"Default values\n"
-	"    -c %.1f\n"
-	"    -t %.2f\n"
-	"    -r %.3f\n"
-	"\n"
-	"Input Data\n"
-	"    From its standard input, the program reads:\n"
-	"        a starting date\n"
-	"        an ending date\n"
-	"        and a list of filenames\n"
-	"    The files must be in CSV format, with column labels\n"
-	"\n"
-	"Example usage (using the getstock program to get the data)\n"
-	"    $ ./getstock -k apikey -b 2018-01-01 -e 2018-04-01 -o data -- JPM BAC GS | %s -c 100000 -t 10.0 -r 0.02\n"
-	"\n"
-	,argv0
-	,DEFAULT_INITIAL_CAPITAL
-	,DEFAULT_TCOST
-	,DEFAULT_MIN_RETURN
-	,argv0);
-	exit(1);
+	/* R is column major, so each block of columns is contiguous */
+	X.resize(T, cols[r]);
+	MPI_Scatterv(R.data(), counts.data(), displs.data(), MPI_DOUBLE,
+	             X.data(), counts[r], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	X.rowwise() -= X.colwise().mean();
+
+	MatrixXd D = MatrixXd::Zero(cols[r], cols[r]);
+	D.selfadjointView<Upper>().rankUpdate(X.transpose());
+	D.triangularView<StrictlyLower>() = D.transpose();
+	tiles.assign(D.data(), D.data() + D.size());
+	held = X;
+	for (int s = 1; s <= nsteps; s++) {
+		int from = block(r, s), next = (r + 1) % P, prev = (r - 1 + P) % P;
+		if (!computes(r, s))
+			prev = MPI_PROC_NULL;
+		if (!computes(next, s))
+			next = MPI_PROC_NULL;
+		recv.resize(T, prev == MPI_PROC_NULL ? 0 : cols[from]);
+		MPI_Sendrecv(held.data(), held.size(), MPI_DOUBLE, next, s,
+		             recv.data(), recv.size(), MPI_DOUBLE, prev, s,
+		             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		held.swap(recv);
+		if (computes(r, s)) {
+			MatrixXd G = X.transpose() * held;
+			tiles.insert(tiles.end(), G.data(), G.data() + G.size());
+		}
+	}
+
+	/* gather every rank's tiles, in the order they were computed */
+	vector<int> sizes(P), offsets(P);
+	int total = 0;
+	for (int q = 0; q < P; q++) {
+		sizes[q] = cols[q] * cols[q];
+		for (int s = 1; s <= nsteps; s++) {
+			if (computes(q, s))
+				sizes[q] += cols[q] * cols[block(q, s)];
+		}
+		offsets[q] = total;
+		total += sizes[q];
+	}
+	vector<double> all(r == 0 ? total : 0);
+	MPI_Gatherv(tiles.data(), tiles.size(), MPI_DOUBLE, all.data(), sizes.data(),
+	            offsets.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	if (r != 0)
+		return C;
+
+	C.resize(n, n);
+	for (int q = 0; q < P; q++) {
+		double const *p = all.data() + offsets[q];
+		C.block(first[q], first[q], cols[q], cols[q]) = Map<MatrixXd const>(p, cols[q], cols[q]);
+		p += cols[q] * cols[q];
+		for (int s = 1; s <= nsteps; s++) {
+			if (!computes(q, s))
+				continue;
+			int b = block(q, s);
+			Map<MatrixXd const> G(p, cols[q], cols[b]);
+			C.block(first[q], first[b], cols[q], cols[b]) = G;
+			C.block(first[b], first[q], cols[b], cols[q]) = G.transpose();
+			p += cols[q] * cols[b];
+		}
+	}
+	return C / (double) (T - 1);
 }
+#endif
 
 /*
- * R = returns matrix
- * C = covariance matrix
- * mean_returns = vector of the average returns for each security
- * min_return = lower bound (measured in dollars) of the desired account value
- * init_capital = the initial capital after accounting for transaction costs of purchasing the securities
- * 'weights', 'variances', and 'returns' are output parameters containing the results of the simulation
+ * psd_project
+ *   replace C by the nearest (in the Frobenius norm) positive semi-definite
+ *   matrix, by clipping its negative eigenvalues to zero. Pairwise and
+ *   realized covariances need not be semi-definite, while chol, the sampler
+ *   and the QP solvers assume they are. A C which factors as it is, is left
+ *   alone without the eigendecomposition. Returns the number of eigenvalues
+ *   clipped.
+ */
+int psd_project(MatrixXd *C)
+{
+	int k;
+	double tol;
+
+	if (C->size() == 0)
+		return 0;
+	LLT<MatrixXd> llt(*C);
+	if (llt.info() == Success)
+		return 0;
+	SelfAdjointEigenSolver<MatrixXd> es(*C);
+	VectorXd d = es.eigenvalues();
+	tol = C->cols() * numeric_limits<double>::epsilon() * d.cwiseAbs().maxCoeff();
+	k = (d.array() < -tol).count();
+	if (k == 0)
+		return 0;
+	d = d.cwiseMax(0.0);
+	*C = es.eigenvectors() * d.asDiagonal() * es.eigenvectors().transpose();
+	return k;
+}
+
+/*
+ * cov_masked
+ *   pairwise complete covariance: C(i, k) is the sample covariance of columns
+ *   i and k over only the rows where both are present.
+ *   X = observations, 0.0 where missing
+ *   M = 1.0 where X is present, 0.0 otherwise
+ *   N = output parameter, N(i, k) = the number of rows used for C(i, k)
  *
- * Returns the index [0,n) corresponding with the set of parameters for which the
- * minimum return was satisfied and the variance was minimized.
- * If there are no feasible solutions, -1 is returned.
+ * Because X is zero where it is missing, every pairwise sum is a matrix product:
+ *   N  = M' * M       counts of rows where both are present
+ *   S  = X' * M       S(i, k) = sum of column i over the rows where k is present
+ *   XX = X' * X       co-moments, a symmetric rank-k update (SYRK)
+ * so that
+ *   C(i, k) = (XX(i, k) - S(i, k) * S(k, i) / N(i, k)) / (N(i, k) - 1)
+ * Pairs with fewer than 2 common rows get a covariance of 0.
+ * Unlike cov(), the pairwise estimate need not be positive semi-definite, so
+ * it is projected onto the semi-definite matrices, see psd_project.
  */
-int run(MatrixXd const & R, MatrixXd const & C, VectorXd mean_returns,
-         int nsim, double min_return, double init_capital,
-	 vector<VectorXd> *weights,
-	 vector<double> *variances,
-	 vector<double> *returns)
+MatrixXd cov_masked(MatrixXd const & X, MatrixXd const & M, MatrixXd *N)
 {
-	if (init_capital < 0) {
-		return -1;
+	MatrixXd C, S, XX;
+	int ncol, i, k;
+
+	ncol = X.cols();
+	N->setZero(ncol, ncol);
+	N->selfadjointView<Upper>().rankUpdate(M.transpose());
+	XX.setZero(ncol, ncol);
+	XX.selfadjointView<Upper>().rankUpdate(X.transpose());
+	S = X.transpose() * M;
+	C.resize(ncol, ncol);
+
+	for (k = 0; k < ncol; k++) {
+		for (i = 0; i <= k; i++) {
+			double n = (*N)(i, k);
+			C(i, k) = (n < 2) ? 0.0 : (XX(i, k) - S(i, k) * S(k, i) / n) / (n - 1);
+			C(k, i) = C(i, k);
+			(*N)(k, i) = n;
+		}
 	}
-	int n;
-	int ncol;
-	ncol = C.cols(); /* number of columns, or stocks/variables in dataset */
+	int clipped = psd_project(&C);
+	if (clipped > 0)
+		warn("Pairwise covariance matrix is not positive semi-definite, clipped %d negative eigenvalues\n", clipped);
+	return C;
+}
+
+
+/*
+ * bits_from_mask
+ *   pack each column of a 0/1 mask into a bitmask of 64 rows per word.
+ *   Column j occupies words [j * nwords, (j + 1) * nwords).
+ */
+vector<uint64_t> bits_from_mask(MatrixXd const & M, int *nwords)
+{
+	int nrow, ncol, i, j;
+	vector<uint64_t> bits;
+
+	nrow = M.rows();
+	ncol = M.cols();
+	*nwords = (nrow + 63) / 64;
+	bits.assign((size_t) ncol * *nwords, 0);
+	for (j = 0; j < ncol; j++) {
+		uint64_t *b = bits.data() + (size_t) j * *nwords;
+		for (i = 0; i < nrow; i++) {
+			if (M(i, j) != 0.0)
+				b[i / 64] |= (uint64_t) 1 << (i % 64);
+		}
+	}
+	return bits;
+}
+
+/*
+ * cov_pairwise
+ *   pairwise complete covariance, the same estimate as cov_masked, computed by
+ *   a kernel that works on bitmasks of the available rows instead of matrix
+ *   products. For every pair and every 64 rows:
+ *     - the rows the pair has in common are the AND of the two words, and
+ *       their count is a popcount
+ *     - if no rows are in common the word is skipped altogether
+ *     - if all 64 are, the sums and co-moments are plain (SIMD) array sums
+ *     - otherwise we visit just the set bits
+ *   Stocks that only trade for part of the window have mostly empty words, so
+ *   this is much cheaper than cov_masked when the panel has many gaps.
+ *   Pairs are processed in tiles of columns which stay in cache, and the tiles
+ *   are spread over threads.
+ *
+ *   X = observations, 0.0 where missing
+ *   M = 1.0 where X is present, 0.0 otherwise
+ *   N = output parameter, the number of rows used for each entry of C
+ */
+MatrixXd cov_pairwise(MatrixXd const & X, MatrixXd const & M, MatrixXd *N)
+{
+	int ncol, nwords, ntiles, t;
+	vector<uint64_t> bits;
+	vector<pair<int, int> > tiles;
+	MatrixXd Xc, C;
+
+	ncol = X.cols();
+	bits = bits_from_mask(M, &nwords);
+
+	/* shift each column by its own mean, for accuracy. The covariance does not change. */
+	RowVectorXd mu = X.colwise().sum().cwiseQuotient(M.colwise().sum().cwiseMax(1.0));
+	Xc = (X.rowwise() - mu).cwiseProduct(M);
+
+	ntiles = (ncol + PAIRWISE_TILE - 1) / PAIRWISE_TILE;
+	for (int tj = 0; tj < ntiles; tj++)
+		for (int ti = 0; ti <= tj; ti++)
+			tiles.emplace_back(ti, tj);
+	C.resize(ncol, ncol);
+	N->resize(ncol, ncol);
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (t = 0; t < (int) tiles.size(); t++) {
+		int i0 = tiles[t].first * PAIRWISE_TILE;
+		int k0 = tiles[t].second * PAIRWISE_TILE;
+		int i1 = min(i0 + PAIRWISE_TILE, ncol);
+		int k1 = min(k0 + PAIRWISE_TILE, ncol);
+		for (int k = k0; k < k1; k++) {
+			uint64_t const *bk = bits.data() + (size_t) k * nwords;
+			double const *xk = Xc.col(k).data();
+			for (int i = i0; i < min(i1, k + 1); i++) {
+				uint64_t const *bi = bits.data() + (size_t) i * nwords;
+				double const *xi = Xc.col(i).data();
+				long n = 0;
+				double si = 0.0, sk = 0.0, sik = 0.0;
+				for (int w = 0; w < nwords; w++) {
+					uint64_t m = bi[w] & bk[w];
+					if (m == 0)
+						continue;
+					n += __builtin_popcountll(m);
+					if (m == ~(uint64_t) 0) {
+						Map<const ArrayXd> a(xi + 64 * w, 64), b(xk + 64 * w, 64);
+						si += a.sum();
+						sk += b.sum();
+						sik += (a * b).sum();
+					} else {
+						while (m) {
+							int r = 64 * w + __builtin_ctzll(m);
+							si += xi[r];
+							sk += xk[r];
+							sik += xi[r] * xk[r];
+							m &= m - 1;
+						}
+					}
+				}
+				C(i, k) = C(k, i) = (n < 2) ? 0.0 : (sik - si * sk / n) / (n - 1);
+				(*N)(i, k) = (*N)(k, i) = n;
+			}
+		}
+	}
+	int clipped = psd_project(&C);
+	if (clipped > 0)
+		warn("Pairwise covariance matrix is not positive semi-definite, clipped %d negative eigenvalues\n", clipped);
+	return C;
+}
+
+
+/*
+ * hy_pair
+ *   the Hayashi-Yoshida covariance of two series of log prices x (at times t)
+ *   and y (at times s):
+ *     sum over i, k of dx_i * dy_k, for the pairs of intervals (t_i-1, t_i]
+ *     and (s_k-1, s_k] which overlap
+ *   The intervals of y which overlap (t_i-1, t_i] are a run a..b, so their sum
+ *   telescopes to y_b - y_a-1, and a and b only move forward with i: a single
+ *   merge over the two sorted sets of times.
+ */
+static double hy_pair(timestamp const *t, double const *x, int n,
+                      timestamp const *s, double const *y, int m)
+{
+	double sum = 0.0;
+	int i, a = 1, b = 1;
+
+	if (n < 2 || m < 2)
+		return 0.0;
+	for (i = 1; i < n; i++) {
+		while (a < m && s[a] <= t[i - 1])
+			a++;
+		while (b + 1 < m && s[b] < t[i])
+			b++;
+		if (a <= b && s[a] > t[i - 1] && s[b - 1] < t[i])
+			sum += (x[i] - x[i - 1]) * (y[b] - y[a - 1]);
+	}
+	return sum;
+}
+
+/*
+ * cov_hy
+ *   realized covariance of asynchronous ticks (Hayashi-Yoshida). Unlike cov()
+ *   on periodReturns, no prices are thrown away resampling onto a common grid,
+ *   and trades which are not synchronized do not bias the covariances to zero.
+ *   Only the window every series covers is used, and the result is scaled from
+ *   that window to one 'period', to match the returns of periodReturns.
+ *   Pairs are processed in tiles of series, spread over threads as in
+ *   cov_pairwise. Unlike cov(), the estimate need not be positive semi-definite,
+ *   so it is projected onto the semi-definite matrices, see psd_project.
+ */
+MatrixXd cov_hy(map<string, ticks> const & data, timestamp period)
+{
+	vector<ticks const *> series;
+	vector<vector<double> > logp;
+	vector<int> lo, hi;
+	timestamp t0, t1;
+	int n, ntiles, j, t;
+	vector<pair<int, int> > tiles;
+	MatrixXd C;
+
+	t0 = numeric_limits<timestamp>::min();
+	t1 = numeric_limits<timestamp>::max();
+	for (auto const & d : data) {
+		series.push_back(&d.second);
+		t0 = max(t0, d.second.t.front());
+		t1 = min(t1, d.second.t.back());
+	}
+	n = series.size();
+	C = MatrixXd::Zero(n, n);
+	if (t1 <= t0)
+		return C;
+	logp.resize(n);
+	lo.resize(n);
+	hi.resize(n);
+	for (j = 0; j < n; j++) {
+		vector<timestamp> const & tt = series[j]->t;
+		/* the last tick at or before t0, up to the first at or after t1 */
+		lo[j] = upper_bound(tt.begin(), tt.end(), t0) - tt.begin() - 1;
+		hi[j] = lower_bound(tt.begin(), tt.end(), t1) - tt.begin() + 1;
+		logp[j].resize(tt.size());
+		for (int k = lo[j]; k < hi[j]; k++)
+			logp[j][k] = log(series[j]->p[k]);
+	}
+
+	ntiles = (n + PAIRWISE_TILE - 1) / PAIRWISE_TILE;
+	for (int tj = 0; tj < ntiles; tj++)
+		for (int ti = 0; ti <= tj; ti++)
+			tiles.emplace_back(ti, tj);
+	double scale = (double) period / (double) (t1 - t0);
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (t = 0; t < (int) tiles.size(); t++) {
+		int i0 = tiles[t].first * PAIRWISE_TILE;
+		int k0 = tiles[t].second * PAIRWISE_TILE;
+		int i1 = min(i0 + PAIRWISE_TILE, n);
+		int k1 = min(k0 + PAIRWISE_TILE, n);
+		for (int k = k0; k < k1; k++) {
+			for (int i = i0; i < min(i1, k + 1); i++) {
+				double c = hy_pair(series[i]->t.data() + lo[i], logp[i].data() + lo[i], hi[i] - lo[i],
+				                   series[k]->t.data() + lo[k], logp[k].data() + lo[k], hi[k] - lo[k]);
+				C(i, k) = C(k, i) = c * scale;
+			}
+		}
+	}
+	int clipped = psd_project(&C);
+	if (clipped > 0)
+		warn("Hayashi-Yoshida covariance matrix is not positive semi-definite, clipped %d negative eigenvalues\n", clipped);
+	return C;
+}
+
+/*
+ * chol
+ *   return the lower triangular factor L of the covariance matrix, C = L * L'
+ *
+ * With short sample windows C is often only positive semi-definite, and
+ * the usual factorization breaks down. In that case we fall back to an
+ * unpivoted factorization which zeroes the column of any pivot that is not
+ * (numerically) positive. For a semi-definite matrix such a row of C is a
+ * linear combination of the rows before it, so L * L' still reproduces C.
+ */
+MatrixXd chol(MatrixXd const & C)
+{
+	int n, j;
+	double tol;
+	MatrixXd L;
+
+	LLT<MatrixXd> llt(C);
+	if (llt.info() == Success) {
+		return llt.matrixL();
+	}
+	n = C.cols();
+	L = MatrixXd::Zero(n, n);
+	tol = n * numeric_limits<double>::epsilon() * C.diagonal().maxCoeff();
+	for (j = 0; j < n; j++) {
+		double d = C(j, j) - L.row(j).head(j).squaredNorm();
+		if (d <= tol) {
+			continue;  /* column j of L stays zero */
+		}
+		L(j, j) = sqrt(d);
+		L.col(j).tail(n - j - 1) = (C.col(j).tail(n - j - 1) -
+		                            L.block(j + 1, 0, n - j - 1, j) * L.row(j).head(j).transpose()) / L(j, j);
+	}
+	return L;
+}
+
+/* soft thresholding operator, sign(x) * max(|x| - t, 0) */
+static inline double soft(double x, double t)
+{
+	if (x > t)
+		return x - t;
+	if (x < -t)
+		return x + t;
+	return 0.0;
+}
+
+/*
+ * glasso_block
+ *   block coordinate descent for the graphical lasso (Friedman, Hastie,
+ *   Tibshirani 2008) on one connected component.
+ *   S = covariance of the component, W, B = in/out estimated covariance and
+ *   regression coefficients, column j of B regresses variable j on the others
+ *
+ * The lasso sweeps are sequential, and each change of a coefficient b_k moves
+ * all of W * b. So that a single big component (with a market factor, every
+ * stock is in one) still uses the threads, a sweep takes GLASSO_SWEEP_BLOCK
+ * coordinates at a time: within the block only the block's rows of W * b are
+ * kept up to date, which is all the block reads, and then the other rows are
+ * brought up to date with the block's changes, split over threads by rows.
+ * The iterates are those of the plain sweep, which is what a small component
+ * (or one of many solved in parallel, see glasso) runs: one block of all p.
+ */
+static void glasso_block(MatrixXd const & S, double lambda, MatrixXd & W, MatrixXd & B,
+                         int maxit, double tol)
+{
+	int p, it, inner, j, k, k0, m, bs;
+	double thresh, dw, dmax;
+	VectorXd Wb, b0, d, keep;
+	vector<int> chg;   /* the coordinates of the block which changed, by d */
+
+	p = S.cols();
+	bs = p;
+	if (p >= GLASSO_PAR_MIN && omp_get_max_threads() > 1 && !omp_in_parallel())
+		bs = GLASSO_SWEEP_BLOCK;
+	d.resize(bs);
+	keep.resize(bs);
+	chg.resize(bs);
+	/* convergence is measured against the size of the off diagonal of S */
+	thresh = 0.0;
+	for (j = 0; j < p; j++)
+		for (k = 0; k < p; k++)
+			if (k != j)
+				thresh += fabs(S(k, j));
+	thresh = tol * max(thresh / (p * (p - 1)), 1e-12);
+
+	for (it = 0; it < maxit; it++) {
+		dw = 0.0;
+		for (j = 0; j < p; j++) {
+			/* lasso: min 1/2 b'W11 b - b's12 + lambda |b|_1, where W11 is W without
+			 * row and column j. B(j, j) is kept at zero, so W * b == W11 * b
+			 * in every entry except j, which we never read. */
+			b0 = B.col(j);
+			Wb = VectorXd::Zero(p);
+			for (k = 0; k < p; k++)
+				if (B(k, j) != 0.0)
+					Wb += W.col(k) * B(k, j);
+			for (inner = 0; inner < maxit; inner++) {
+				dmax = 0.0;
+				for (k0 = 0; k0 < p; k0 += m) {
+					int nchg = 0;
+					m = min(bs, p - k0);
+					for (k = k0; k < k0 + m; k++) {
+						if (k == j)
+							continue;
+						double old = B(k, j);
+						double g = S(k, j) - (Wb(k) - W(k, k) * old);
+						double b = soft(g, lambda) / W(k, k);
+						if (b != old) {
+							if (m == p) {
+								Wb += W.col(k) * (b - old);
+							} else {
+								Wb.segment(k0, m) += W.col(k).segment(k0, m) * (b - old);
+								chg[nchg] = k;
+								d(nchg++) = b - old;
+							}
+							B(k, j) = b;
+							dmax = max(dmax, fabs(b - old));
+						}
+					}
+					if (nchg == 0 || m == p)
+						continue;
+					/* the rows outside the block: update them all, and put
+					 * back the block's own, which are already up to date */
+					keep.head(m) = Wb.segment(k0, m);
 #pragma omp parallel
+					{
+						int t = omp_get_thread_num(), nt = omp_get_num_threads();
+						int r0 = (long) p * t / nt, r1 = (long) p * (t + 1) / nt;
+						for (int c = 0; c < nchg; c++)
+							Wb.segment(r0, r1 - r0) += W.col(chg[c]).segment(r0, r1 - r0) * d(c);
+					}
+					Wb.segment(k0, m) = keep.head(m);
+				}
+				if (dmax < thresh)
+					break;
+			}
+			/* W stays positive definite if w_jj > b' W11 b. That holds at the
+			 * lasso's solution, but not always where the sweeps stopped short
+			 * of it, and an indefinite W makes the sweeps diverge: if it does
+			 * not hold, leave column j as it was until the next pass. */
+			if (!(B.col(j).dot(Wb) < W(j, j))) {
+				B.col(j) = b0;
+				continue;
+			}
+			for (k = 0; k < p; k++) {
+				if (k == j)
+					continue;
+				dw += fabs(Wb(k) - W(k, j));
+				W(k, j) = W(j, k) = Wb(k);
+			}
+		}
+		if (dw / (p * (p - 1)) < thresh)
+			break;
+	}
+}
+
+/*
+ * glasso
+ *   graphical lasso estimate of a sparse inverse covariance (precision) matrix
+ *
+ * S      = covariance matrix. Usually a correlation matrix, so that a single
+ *          lambda means the same thing for every pair of stocks
+ * lambda = l1 penalty on the off diagonal entries of the precision matrix
+ * W, B   = in/out parameters. The penalized covariance estimate, and the
+ *          regression coefficients of each variable on the others. If they
+ *          have the right shape on entry they are used as a warm start, so
+ *          a path of decreasing lambdas costs little more than the last one
+ *
+ * Variables i and j can only be connected in the precision matrix if they are
+ * connected in the graph |S(i, j)| > lambda (Mazumder & Hastie 2012), so the
+ * problem splits into independent blocks which are solved in parallel. That
+ * only helps when the graph does split; with a common market factor it is
+ * usually one block, so a block of GLASSO_PAR_MIN or more is instead solved
+ * alone, with its sweeps threaded inside (see glasso_block).
+ */
+SparseMatrix<double> glasso(MatrixXd const & S, double lambda, MatrixXd *W, MatrixXd *B,
+                            int maxit = 100, double tol = 1e-4)
+{
+	int n, i, j, c, big;
+	vector<int> parent;
+	vector<vector<int> > comps;
+	vector<Triplet<double> > triplets;
+	MatrixXd Wn, Bn;
+	bool warm;
+
+	n = S.cols();
+	warm = W->rows() == n && W->cols() == n && B->rows() == n && B->cols() == n;
+
+	/* connected components of the thresholded covariance graph */
+	parent.resize(n);
+	for (i = 0; i < n; i++)
+		parent[i] = i;
+	auto root = [&](int x) {
+		while (parent[x] != x)
+			x = parent[x] = parent[parent[x]];
+		return x;
+	};
+	for (j = 0; j < n; j++)
+		for (i = 0; i < j; i++)
+			if (fabs(S(i, j)) > lambda)
+				parent[root(i)] = root(j);
 	{
-		if (omp_get_thread_num() == 0)
-			n = omp_get_num_threads();
+		map<int, vector<int> > bycomp;
+		for (i = 0; i < n; i++)
+			bycomp[root(i)].push_back(i);
+		for (auto & pair : bycomp)
+			comps.emplace_back(move(pair.second));
 	}
-#pragma omp barrier
+	/* biggest blocks first, so they do not end up running alone at the end */
+	sort(comps.begin(), comps.end(), [](vector<int> const & a, vector<int> const & b) {
+		return a.size() > b.size();
+	});
 
-#pragma omp parallel num_threads(n)
+	Wn = MatrixXd::Zero(n, n);
+	Bn = MatrixXd::Zero(n, n);
+	auto solve = [&](vector<int> const & idx, vector<Triplet<double> > & out) {
+		int p = idx.size();
+		int ii, jj;
+		MatrixXd Sc(p, p), Wc(p, p), Bc(p, p);
+
+		for (jj = 0; jj < p; jj++) {
+			for (ii = 0; ii < p; ii++) {
+				Sc(ii, jj) = S(idx[ii], idx[jj]);
+				Wc(ii, jj) = warm ? (*W)(idx[ii], idx[jj]) : Sc(ii, jj);
+				Bc(ii, jj) = warm ? (*B)(idx[ii], idx[jj]) : 0.0;
+			}
+			Wc(jj, jj) = Sc(jj, jj) + lambda;
+			Bc(jj, jj) = 0.0;
+		}
+		if (p > 1)
+			glasso_block(Sc, lambda, Wc, Bc, maxit, tol);
+		for (jj = 0; jj < p; jj++) {
+			/* theta_jj = 1 / (w_jj - w12' b), theta_12 = -b theta_jj */
+			double theta = 1.0 / (Wc(jj, jj) - Wc.col(jj).dot(Bc.col(jj)));
+			out.emplace_back(idx[jj], idx[jj], theta);
+			for (ii = 0; ii < p; ii++) {
+				Wn(idx[ii], idx[jj]) = Wc(ii, jj);
+				Bn(idx[ii], idx[jj]) = Bc(ii, jj);
+				if (Bc(ii, jj) != 0.0) {
+					/* the estimate is not exactly symmetric, average the two halves */
+					out.emplace_back(idx[ii], idx[jj], -0.5 * Bc(ii, jj) * theta);
+					out.emplace_back(idx[jj], idx[ii], -0.5 * Bc(ii, jj) * theta);
+				}
+			}
+		}
+	};
+	/* a block big enough to thread its own sweeps (see glasso_block) gets all
+	 * the threads to itself, the smaller ones are solved side by side */
+	for (big = 0; big < (int) comps.size() && (int) comps[big].size() >= GLASSO_PAR_MIN; big++)
+		solve(comps[big], triplets);
+#pragma omp parallel
 	{
-		/* collecting stats, tl stands for 'thread-local'
-		 * we will aggregate all these together in 3 vectors, and report
-		 * our findings to the main thread after all these threads finish simulation.
-		 */ 
-		vector<VectorXd> tl_weights;
-		vector<double> tl_returns;
-		vector<double> tl_variances;
+		vector<Triplet<double> > tl_triplets;
+#pragma omp for schedule(dynamic, 1)
+		for (c = big; c < (int) comps.size(); c++)
+			solve(comps[c], tl_triplets);
+#pragma omp critical
+		triplets.insert(triplets.end(), tl_triplets.begin(), tl_triplets.end());
+	}
+	*W = move(Wn);
+	*B = move(Bn);
 
-		tl_weights.reserve(nsim / n);
-		tl_returns.reserve(nsim / n);
-		tl_variances.reserve(nsim / n);
+	SparseMatrix<double> Theta(n, n);
+	Theta.setFromTriplets(triplets.begin(), triplets.end());  /* duplicates are summed */
+	Theta.prune(0.0);
+	return Theta;
+}
 
-		VectorXd w;
-		w.resize(ncol);  /* one weight per security */
+/*
+ * glasso_weights
+ *   the minimum variance portfolio w = Theta * 1 / (1' * Theta * 1), where
+ *   Theta is the graphical lasso estimate of the precision matrix.
+ *   W, B = in/out, the state of the solver (see glasso). If they hold the
+ *          solution for a nearby C, only the final solve is repeated
+ *   *lambda is clamped to the smallest penalty for which Theta is diagonal,
+ *   *nnz and *var are set to the nonzeros of Theta and the model variance of w.
+ *
+ * The penalty is applied to the correlation matrix. We start from the
+ * smallest penalty for which Theta is diagonal and walk down to 'lambda',
+ * warm starting each solve from the previous one. With Theta in hand the
+ * portfolio is a sparse matrix-vector product, no n-by-n solve is needed.
+ * Note the weights are not constrained to be positive.
+ */
+VectorXd glasso_weights(MatrixXd const & C, double *lambda, MatrixXd *W, MatrixXd *B,
+                        long *nnz, double *var)
+{
+	int n, i, j, k;
+	double lmax, l;
+	VectorXd sd, x;
+	MatrixXd P;
+	SparseMatrix<double> Theta;
+	bool warm;
+
+	n = C.cols();
+	warm = W->rows() == n && W->cols() == n;
+	sd = C.diagonal().cwiseSqrt();
+	P = sd.cwiseInverse().asDiagonal() * C * sd.cwiseInverse().asDiagonal();
+	lmax = 0.0;
+	for (j = 0; j < n; j++)
+		for (i = 0; i < j; i++)
+			lmax = max(lmax, fabs(P(i, j)));
+	if (*lambda > lmax)
+		*lambda = lmax;
+
+	for (k = warm ? 0 : GLASSO_PATH_LENGTH - 1; k >= 0; k--) {
+		l = *lambda * pow(lmax / *lambda, (double) k / GLASSO_PATH_LENGTH);
+		Theta = glasso(P, l, W, B);
+	}
+	Theta = sd.cwiseInverse().asDiagonal() * Theta * sd.cwiseInverse().asDiagonal();
+
+	x = Theta * VectorXd::Ones(n);
+	*nnz = Theta.nonZeros();
+	*var = 1.0 / x.sum();
+	return x / x.sum();
+}
+
+/* print the portfolio of glasso_weights */
+void glasso_print(vector<string> const & tickers, MatrixXd const & C, VectorXd const & mean_returns,
+                  VectorXd const & w, double lambda, long nnz, double var)
+{
+	int i, n;
+
+	n = C.cols();
+	printf("Graphical lasso, lambda = %.4f, nonzeros in precision matrix: %ld of %d\n",
+	       lambda, nnz, n * n);
+	for (i = 0; i < n; i++) {
+		printf("%s %10.6f\n", tickers[i].c_str(), w[i]);
+	}
+	printf("Expected return: %.6f\n", w.dot(mean_returns));
+	printf("Min variance:    %.6f (sample), %.6f (model)\n", w.dot(C * w), var);
+	printf("net weight: %.4f\n", w.sum());
+}
+
+VectorXd glasso_portfolio(vector<string> const & tickers, MatrixXd const & C,
+                          VectorXd const & mean_returns, double lambda)
+{
+	MatrixXd W, B;
+	long nnz;
+	double var;
+
+	VectorXd w = glasso_weights(C, &lambda, &W, &B, &nnz, &var);
+	glasso_print(tickers, C, mean_returns, w, lambda, nnz, var);
+	return w;
+}
+
+/*
+ * read_weights
+ *   read a file of
+ *     TICKER value
+ *   lines (whitespace or comma separated, '#' starts a comment), such as market
+ *   capitalizations or index weights, into a vector over 'tickers'. Tickers
+ *   which are not in the file get 0. The values are not normalized.
+ */
+VectorXd read_weights(char const *path, vector<string> const & tickers)
+{
+	map<string, int> column;
+	VectorXd w;
+	FILE *file;
+	char buf[256];
+
+	for (int i = 0; i < (int) tickers.size(); i++)
+		column[tickers[i]] = i;
+	w = VectorXd::Zero(tickers.size());
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		die("Failed to read weights\n");
+	}
+	while (fgets(buf, sizeof buf, file)) {
+		char *hash = strchr(buf, '#');
+		if (hash)
+			*hash = '\0';
+		char *ticker = strtok(buf, " \t\r\n,");
+		char *value = ticker ? strtok(NULL, " \t\r\n,") : NULL;
+		if (!value)
+			continue;
+		char *endptr;
+		double x = strtod(value, &endptr);
+		if (endptr == value) {
+			warn("Bad weight for %s in %s\n", ticker, path);
+			continue;
+		}
+		auto it = column.find(upper(ticker));
+		if (it != column.end())
+			w(it->second) = x;
+	}
+	fclose(file);
+	return w;
+}
+
+/*
+ * read_views
+ *   read Black-Litterman views, one per line:
+ *     [coef] TICKER [+|- [coef] TICKER ...] = return [sd]
+ *   e.g.
+ *     JPM = 0.004                   JPM returns 0.4% a period
+ *     JPM - BAC = 0.001 0.0005      JPM beats BAC by 0.1%, give or take 0.05%
+ *   Without sd the view is as uncertain as the equilibrium, see black_litterman.
+ *   '#' starts a comment. Views on tickers we do not have are dropped.
+ *   Sets P (one row per view), Q and sd (0 where not given).
+ */
+void read_views(char const *path, vector<string> const & tickers,
+                MatrixXd *P, VectorXd *Q, VectorXd *sd)
+{
+	map<string, int> column;
+	vector<VectorXd> rows;
+	vector<double> q, s;
+	FILE *file;
+	char buf[1024];
+	int lineno = 0;
+
+	for (int i = 0; i < (int) tickers.size(); i++)
+		column[tickers[i]] = i;
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		die("Failed to read views\n");
+	}
+	while (fgets(buf, sizeof buf, file)) {
+		VectorXd p = VectorXd::Zero(tickers.size());
+		double sign = 1.0, coef = 1.0, value = 0.0, dev = 0.0;
+		int nterms = 0, ok = 1, rhs = 0, nrhs = 0;
+		char *hash = strchr(buf, '#');
+
+		lineno++;
+		if (hash)
+			*hash = '\0';
+		for (char *tok = strtok(buf, " \t\r\n"); tok && ok; tok = strtok(NULL, " \t\r\n")) {
+			char *endptr;
+			if (rhs) {
+				double x = strtod(tok, &endptr);
+				if (endptr == tok || *endptr || nrhs == 2) {
+					ok = 0;
+				} else if (nrhs++ == 0) {
+					value = x;
+				} else {
+					dev = x;
+				}
+			} else if (strcmp(tok, "=") == 0) {
+				rhs = 1;
+			} else if (strcmp(tok, "+") == 0) {
+				sign = 1.0;
+			} else if (strcmp(tok, "-") == 0) {
+				sign = -1.0;
+			} else {
+				if (*tok == '-' || *tok == '+') {
+					sign = (*tok == '-') ? -1.0 : 1.0;
+					tok++;
+				}
+				double x = strtod(tok, &endptr);
+				if (endptr != tok && *endptr == '\0') {
+					coef = x;
+					continue;
+				}
+				auto it = column.find(upper(tok));
+				if (it == column.end()) {
+					warn("%s:%d: no data for %s, dropping the view\n", path, lineno, tok);
+					ok = 0;
+					break;
+				}
+				p(it->second) += sign * coef;
+				sign = coef = 1.0;
+				nterms++;
+			}
+		}
+		if (!ok || nterms == 0)
+			continue;
+		if (nrhs == 0) {
+			warn("%s:%d: bad view\n", path, lineno);
+			continue;
+		}
+		rows.push_back(p);
+		q.push_back(value);
+		s.push_back(dev);
+	}
+	fclose(file);
+	P->resize(rows.size(), tickers.size());
+	for (int k = 0; k < (int) rows.size(); k++)
+		P->row(k) = rows[k].transpose();
+	*Q = Map<VectorXd>(q.data(), q.size());
+	*sd = Map<VectorXd>(s.data(), s.size());
+}
+
+/*
+ * black_litterman
+ *   expected returns which combine the equilibrium returns pi = delta * C * w,
+ *   of the market portfolio w, with views P * mu = Q:
+ *     mu = pi + tau C P' (P tau C P' + Omega)^-1 (Q - P pi)
+ *   Omega is diagonal: the square of the view's sd, or by default the
+ *   variance of the view under the prior, tau * p' C p (He & Litterman 1999).
+ *   The only system solved is k-by-k, for k views, with a Cholesky
+ *   factorization, so the cost is O(n^2 k) and no n-by-n matrix is inverted.
+ *   Views which are linearly dependent and certain (sd 0, or no variance under
+ *   the prior) make it singular, and it is solved by LDLT instead.
+ */
+VectorXd black_litterman(MatrixXd const & C, VectorXd const & w, MatrixXd const & P,
+                         VectorXd const & Q, VectorXd const & sd)
+{
+	VectorXd pi, omega;
+	MatrixXd CPt, A;
+	LLT<MatrixXd> llt;
+	LDLT<MatrixXd> ldlt;
+
+	pi = BL_DELTA * (C * w);
+	if (P.rows() == 0)
+		return pi;
+	CPt = BL_TAU * (C * P.transpose());   /* n-by-k */
+	A = P * CPt;                          /* k-by-k */
+	omega = A.diagonal();
+	for (int k = 0; k < sd.size(); k++) {
+		if (sd(k) > 0.0)
+			omega(k) = sd(k) * sd(k);
+	}
+	A.diagonal() += omega;
+	llt.compute(A);
+	if (llt.info() == Success)
+		return pi + CPt * llt.solve(Q - P * pi);
+	ldlt.compute(A);
+	if (ldlt.info() != Success)
+		die("Failed to combine the views with the market, check their standard deviations\n");
+	return pi + CPt * ldlt.solve(Q - P * pi);
+}
+
+/*
+ * mst_prim
+ *   the minimum spanning tree of the complete graph with distances D, by
+ *   Prim's algorithm on the dense matrix in O(n^2). Each step the scan for the
+ *   closest vertex and the update of the distances to the tree are split over
+ *   threads (for big enough n).
+ *   Sets the edges (from[k], to[k]), of length len[k].
+ */
+void mst_prim(MatrixXd const & D, vector<int> *from, vector<int> *to, vector<double> *len)
+{
+	int n, u;
+	vector<double> key, bestd;
+	vector<int> parent, bestv;
+	vector<char> done;
+
+	n = D.cols();
+	from->clear();
+	to->clear();
+	len->clear();
+	if (n < 2)
+		return;
+	key.resize(n);
+	parent.assign(n, 0);
+	done.assign(n, 0);
+	bestd.resize(omp_get_max_threads());
+	bestv.resize(omp_get_max_threads());
+	done[0] = 1;
+	for (int v = 0; v < n; v++)
+		key[v] = D(v, 0);
+	u = 0;
+
+#pragma omp parallel if (n > 512)
+	{
+		int t = omp_get_thread_num();
+		int nt = omp_get_num_threads();
+		for (int step = 1; step < n; step++) {
+			double bd = numeric_limits<double>::infinity();
+			int bv = -1;
+#pragma omp for schedule(static) nowait
+			for (int v = 0; v < n; v++) {
+				if (!done[v] && (bv == -1 || key[v] < bd)) {
+					bd = key[v];
+					bv = v;
+				}
+			}
+			bestd[t] = bd;
+			bestv[t] = bv;
+#pragma omp barrier
+#pragma omp single
+			{
+				int k, best = -1;
+				for (k = 0; k < nt; k++) {
+					if (bestv[k] != -1 && (best == -1 || bestd[k] < bestd[best]))
+						best = k;
+				}
+				u = bestv[best];
+				done[u] = 1;
+				from->push_back(parent[u]);
+				to->push_back(u);
+				len->push_back(key[u]);
+			}
+			/* the distances of the rest to the tree, now that u is in it */
+#pragma omp for schedule(static)
+			for (int v = 0; v < n; v++) {
+				if (!done[v] && D(v, u) < key[v]) {
+					key[v] = D(v, u);
+					parent[v] = u;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * hrp_order
+ *   the order of the leaves of the single linkage hierarchy of the correlation
+ *   distance sqrt((1 - rho) / 2), so that similar stocks are next to each
+ *   other (quasi-diagonalization). Single linkage merges the clusters in the
+ *   order of the edges of the minimum spanning tree, shortest first.
+ */
+vector<int> hrp_order(MatrixXd const & C)
+{
+	int n, k;
+	VectorXd sd;
+	MatrixXd D;
+	vector<int> from, to, order, uf, node, stack;
+	vector<double> len;
+	vector<pair<int, int> > children;  /* of the internal node n + k */
+
+	n = C.cols();
+	sd = C.diagonal().cwiseSqrt();
+	D.resize(n, n);
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i < n; i++) {
+			double rho = (sd(i) > 0.0 && sd(j) > 0.0) ? C(i, j) / (sd(i) * sd(j)) : 0.0;
+			D(i, j) = sqrt(max(0.0, 0.5 * (1.0 - rho)));
+		}
+	}
+	mst_prim(D, &from, &to, &len);
+
+	vector<int> edges(from.size());
+	for (k = 0; k < (int) edges.size(); k++)
+		edges[k] = k;
+	stable_sort(edges.begin(), edges.end(), [&](int a, int b) { return len[a] < len[b]; });
+	uf.resize(n);    /* union find over the leaves */
+	node.resize(n);  /* the node of the hierarchy for each set */
+	for (k = 0; k < n; k++)
+		uf[k] = node[k] = k;
+	auto root = [&](int x) {
+		while (uf[x] != x)
+			x = uf[x] = uf[uf[x]];
+		return x;
+	};
+	for (int e : edges) {
+		int a = root(from[e]), b = root(to[e]);
+		children.emplace_back(node[a], node[b]);
+		uf[a] = b;
+		node[b] = n + children.size() - 1;
+	}
+
+	/* the leaves, left to right. The tree can be as deep as n, so no recursion */
+	stack.push_back(n + (int) children.size() - 1);
+	while (!stack.empty()) {
+		int x = stack.back();
+		stack.pop_back();
+		if (x < n) {
+			order.push_back(x);
+		} else {
+			stack.push_back(children[x - n].second);
+			stack.push_back(children[x - n].first);
+		}
+	}
+	return order;
+}
+
+/* variance of the inverse variance portfolio of the stocks ix[0 .. k) */
+static double cluster_variance(MatrixXd const & C, int const *ix, int k)
+{
+	VectorXd w(k);
+	double v = 0.0;
+	int i;
+
+	for (i = 0; i < k; i++)
+		w(i) = 1.0 / max(C(ix[i], ix[i]), numeric_limits<double>::min());
+	w /= w.sum();
+#pragma omp parallel for reduction(+:v) if (k > 512)
+	for (i = 0; i < k; i++) {
+		double s = 0.0;
+		for (int j = 0; j < k; j++)
+			s += C(ix[j], ix[i]) * w(j);
+		v += w(i) * s;
+	}
+	return v;
+}
+
+/*
+ * hrp_weights
+ *   hierarchical risk parity (Lopez de Prado 2016): order the stocks with
+ *   hrp_order, then split the order in halves, recursively, sharing each
+ *   cluster's weight between its halves in inverse proportion to their
+ *   variances. C is never inverted, so this works for the singular matrices
+ *   of short windows, and the whole allocation is O(n^2): each level of the
+ *   bisection costs half as much as the level above it.
+ *   Weights are positive and sum to 1.
+ */
+VectorXd hrp_weights(MatrixXd const & C)
+{
+	int n;
+	VectorXd w;
+	vector<int> order;
+	vector<pair<int, int> > ranges;
+
+	n = C.cols();
+	w = VectorXd::Ones(n);
+	order = hrp_order(C);
+	if (n > 1)
+		ranges.emplace_back(0, n);
+	while (!ranges.empty()) {
+		int lo = ranges.back().first, hi = ranges.back().second;
+		int mid = (lo + hi) / 2;
+		ranges.pop_back();
+		double v0 = cluster_variance(C, order.data() + lo, mid - lo);
+		double v1 = cluster_variance(C, order.data() + mid, hi - mid);
+		double alpha = (v0 + v1 > 0.0) ? 1.0 - v0 / (v0 + v1) : 0.5;
+		for (int k = lo; k < mid; k++)
+			w(order[k]) *= alpha;
+		for (int k = mid; k < hi; k++)
+			w(order[k]) *= 1.0 - alpha;
+		if (mid - lo > 1)
+			ranges.emplace_back(lo, mid);
+		if (hi - mid > 1)
+			ranges.emplace_back(mid, hi);
+	}
+	return w;
+}
+
+VectorXd hrp_portfolio(vector<string> const & tickers, MatrixXd const & C, VectorXd const & mean_returns)
+{
+	VectorXd w = hrp_weights(C);
+
+	printf("Hierarchical risk parity\n");
+	for (int i = 0; i < (int) tickers.size(); i++) {
+		printf("%s %10.6f\n", tickers[i].c_str(), w[i]);
+	}
+	printf("Expected return: %.6f\n", w.dot(mean_returns));
+	printf("Variance:        %.6f\n", w.dot(C * w));
+	printf("net weight: %.4f\n", w.sum());
+	return w;
+}
+
+/*
+ * cov_update
+ *   recompute row and column j of C = cov(R) after column j of R has changed,
+ *   in O(rows * cols) rather than the O(rows * cols^2) of cov()
+ */
+void cov_update(MatrixXd const & R, MatrixXd *C, int j)
+{
+	RowVectorXd means = R.colwise().mean();
+	VectorXd xj = R.col(j).array() - means(j);
+	VectorXd c = (R.rowwise() - means).transpose() * xj / (double) (R.rows() - 1);
+
+	C->col(j) = c;
+	C->row(j) = c.transpose();
+}
+
+/*
+ * watch_portfolio
+ *   watch mode: print the graphical lasso portfolio, then wait for price files
+ *   to be written (or moved in, as getstock does) in the directories of 'files'.
+ *   The tickers they belong to are read again, their columns of R and rows and
+ *   columns of C are updated, and the portfolio is solved again, warm started
+ *   from the last solution. It is printed only when a weight has moved by more
+ *   than WATCH_THRESHOLD since the last one printed.
+ *   Files for tickers which are not in the portfolio are ignored.
+ *   nprices = the number of prices in each column of R, as read by read_stock_data
+ *   Never returns.
+ */
+void watch_portfolio(vector<string> const & files, vector<string> const & tickers,
+                     MatrixXd R, MatrixXd C, VectorXd mean_returns, int nprices,
+                     timestamp begin, timestamp end, double lambda)
+{
+	map<string, int> column;   /* ticker -> column of R */
+	map<int, string> dirs;     /* watch descriptor -> directory, as in 'files' */
+	set<string> watched;
+	MatrixXd W, B;
+	VectorXd w, wn;
+	double l, var;
+	long nnz;
+	int fd, i;
+
+	for (i = 0; i < (int) tickers.size(); i++)
+		column[tickers[i]] = i;
+	lowlat_buffer(&R);
+	lowlat_buffer(&C);
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1) {
+		perror("inotify_init1:");
+		die("Failed to watch the data directories\n");
+	}
+	for (auto const & f : files) {
+		auto slash = f.rfind('/');
+		string dir = (slash == string::npos) ? "" : f.substr(0, slash);
+		if (!watched.insert(dir).second)
+			continue;
+		int wd = inotify_add_watch(fd, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd == -1) {
+			perror(dir.c_str());
+			die("Failed to watch the data directories\n");
+		}
+		dirs[wd] = dir;
+	}
+
+	l = lambda;
+	w = glasso_weights(C, &l, &W, &B, &nnz, &var);
+	glasso_print(tickers, C, mean_returns, w, l, nnz, var);
+	fflush(stdout);
+
+	alignas(struct inotify_event) char buf[4096];
+	for (;;) {
+		ssize_t len = read(fd, buf, sizeof buf);
+		if (len == -1) {
+			if (errno == EINTR && interrupted)
+				exit(0);
+			if (errno == EINTR)
+				continue;
+			perror("read:");
+			die("Failed to watch the data directories\n");
+		}
+		/* a burst of files is read in one go, and solved for once */
+		double t0 = lowlat_clock();
+		map<int, string> changed;  /* column -> newest file */
+		struct inotify_event const *ev;
+		for (char const *p = buf; p < buf + len; p += sizeof *ev + ev->len) {
+			ev = (struct inotify_event const *) p;
+			if (ev->len == 0)
+				continue;
+			string path = dirs[ev->wd];
+			path = path.empty() ? string(ev->name) : path + "/" + ev->name;
+			/* getstock's temporary files do not end in .csv or .bin */
+			if (!is_binary(path.c_str()) && (path.size() < 4 || path.compare(path.size() - 4, 4, ".csv") != 0))
+				continue;
+			auto it = column.find(ticker_from_filename(path.c_str()));
+			if (it != column.end())
+				changed[it->second] = path;
+		}
+		int nupdated = 0;
+		for (auto const & c : changed) {
+			char const *f = c.second.c_str();
+			ticks tk;
+			if (read_ticks(f, begin, end, &tk) == -1) {
+				warn("Failed to read file %s, skipping\n", f);
+				continue;
+			}
+			if ((int) tk.p.size() < nprices) {
+				warn("Not enough observations for %s: has %d of %d required\n",
+				     tickers[c.first].c_str(), (int) tk.p.size(), nprices);
+				continue;
+			}
+			tk.p.resize(nprices);
+			R.col(c.first) = weeklyReturns(tk.p);
+			mean_returns(c.first) = R.col(c.first).mean();
+			cov_update(R, &C, c.first);
+			nupdated++;
+		}
+		if (nupdated == 0)
+			continue;
+		l = lambda;
+		wn = glasso_weights(C, &l, &W, &B, &nnz, &var);
+		lowlat_record(t0);
+		if ((wn - w).cwiseAbs().maxCoeff() > WATCH_THRESHOLD) {
+			w = wn;
+			glasso_print(tickers, C, mean_returns, w, l, nnz, var);
+			fflush(stdout);
+		}
+	}
+}
+
+/*
+ * A covariance over a rolling window of the last 'window' returns, updated
+ * in O(n^2) per return: the new return's outer product is added to the sums,
+ * and that of the return leaving the window subtracted. So that rounding
+ * errors do not build up, the sums are recomputed from the window every
+ * 'window' returns, which adds O(n^2) per return on average.
+ */
+struct rolling_cov {
+	int window, count, head, updates;
+	MatrixXd ring;    /* the returns in the window, one per row */
+	VectorXd sum;
+	MatrixXd sumsq;   /* upper triangle of the sum of r * r' */
+};
+
+rolling_cov rolling_cov_init(int n, int window)
+{
+	rolling_cov rc;
+
+	rc.window = window;
+	rc.count = rc.head = rc.updates = 0;
+	rc.ring = MatrixXd::Zero(window, n);
+	rc.sum = VectorXd::Zero(n);
+	rc.sumsq = MatrixXd::Zero(n, n);
+	return rc;
+}
+
+void rolling_cov_add(rolling_cov *rc, VectorXd const & r)
+{
+	if (rc->count == rc->window) {
+		VectorXd old = rc->ring.row(rc->head).transpose();
+		rc->sum -= old;
+		rc->sumsq.selfadjointView<Upper>().rankUpdate(old, -1.0);
+	} else {
+		rc->count++;
+	}
+	rc->ring.row(rc->head) = r.transpose();
+	rc->head = (rc->head + 1) % rc->window;
+	rc->sum += r;
+	rc->sumsq.selfadjointView<Upper>().rankUpdate(r, 1.0);
+	if (++rc->updates == rc->window) {
+		auto rows = rc->ring.topRows(rc->count);
+		rc->sum = rows.colwise().sum().transpose();
+		rc->sumsq.setZero();
+		rc->sumsq.selfadjointView<Upper>().rankUpdate(rows.transpose());
+		rc->updates = 0;
+	}
+}
+
+MatrixXd rolling_cov_matrix(rolling_cov const & rc)
+{
+	MatrixXd C = rc.sumsq.selfadjointView<Upper>();
+	C -= rc.sum * rc.sum.transpose() / rc.count;
+	return C / (rc.count - 1);
+}
+
+/* the projection of v onto the simplex { w >= 0, sum(w) = 1 } */
+VectorXd simplex_projection(VectorXd const & v)
+{
+	VectorXd u = v;
+	double cum, t, theta;
+
+	sort(u.data(), u.data() + u.size(), greater<double>());
+	cum = 0.0;
+	theta = 0.0;
+	for (int i = 0; i < u.size(); i++) {
+		cum += u(i);
+		t = (cum - 1.0) / (i + 1);
+		if (u(i) > t)
+			theta = t;
+	}
+	return (v.array() - theta).cwiseMax(0.0);
+}
+
+/*
+ * minvar_simplex
+ *   long only minimum variance weights: minimize w' C w subject to w >= 0,
+ *   sum(w) = 1, by projected gradient descent starting from *w.
+ *   *v = in/out, an estimate of the leading eigenvector of C, which gives the
+ *        step size. Both it and *w change little from one bar to the next, so
+ *        warm started they need few iterations.
+ *   returns the number of iterations
+ */
+int minvar_simplex(MatrixXd const & C, VectorXd *w, VectorXd *v, int maxit, double tol)
+{
+	VectorXd g, wn, d;
+	double L, f, fn;
+	int it;
+
+	/* a zero C (e.g. a window of constant prices): every portfolio is optimal */
+	if (C.cwiseAbs().maxCoeff() == 0.0 || !isfinite(C.sum()))
+		return 0;
+	for (it = 0; it < 3; it++) {  /* power iterations */
+		VectorXd Cv = C * *v;
+		double norm = Cv.norm();
+		if (norm == 0.0 || !isfinite(norm)) {
+			/* v fell in the null space of C, or was lost: start over */
+			*v = VectorXd::Constant(C.cols(), 1.0 / sqrt((double) C.cols()));
+			break;
+		}
+		*v = Cv / norm;
+	}
+	L = 2.0 * v->dot(C * *v);
+	if (!isfinite(L) || L < 1e-300)
+		L = 2.0 * C.diagonal().cwiseAbs().maxCoeff();
+	g = 2.0 * C * *w;
+	f = w->dot(g) / 2.0;
+	for (it = 0; it < maxit; it++) {
+		/* back off if the eigenvalue estimate is too small for the step to be safe */
+		int k;
+		for (k = 0; k < STREAM_MAXBACKOFF; k++) {
+			wn = simplex_projection(*w - g / L);
+			d = wn - *w;
+			VectorXd Cwn = C * wn;
+			fn = wn.dot(Cwn);
+			if (fn <= f + g.dot(d) + L / 2.0 * d.squaredNorm() + 1e-15 * fabs(f)) {
+				g = 2.0 * Cwn;
+				break;
+			}
+			L *= 2.0;
+		}
+		if (k == STREAM_MAXBACKOFF)
+			break;
+		*w = wn;
+		f = fn;
+		if (d.lpNorm<Infinity>() < tol)
+			break;
+	}
+	return it;
+}
+
+/*
+ * stream_portfolio
+ *   stream mode: read bars of prices from the standard input, one record of
+ *     date,ticker,close
+ *   per line, where all the records of a bar have the same date (which may
+ *   have a time). A bar ends at the next date, or at a blank line. Prints how
+ *   the long only minimum variance weights change with each bar:
+ *     date ticker change weight
+ *   The tickers are those of the first bar. A ticker missing from a bar keeps
+ *   its last price. Returns are bar to bar, and the covariance is over a
+ *   rolling window of 'window' of them (see rolling_cov). Weights are first
+ *   printed once the window is full, then whenever one has moved by more than
+ *   STREAM_MIN_DELTA since it was last printed.
+ */
+void stream_portfolio(int window)
+{
+	vector<string> tickers;
+	map<string, int> column;
+	set<string> ignored;
+	vector<pair<string, double> > pending;  /* the records of the current bar */
+	string bar;
+	VectorXd last, r, w, v, shown;
+	rolling_cov rc;
+	char buf[256];
+	int n, j;
+
+	auto process = [&]() {
+		if (tickers.empty()) {
+			/* the first bar gives the universe and the first prices */
+			for (auto const & rec : pending) {
+				if (column.count(rec.first))
+					continue;
+				column[rec.first] = tickers.size();
+				tickers.push_back(rec.first);
+			}
+			n = tickers.size();
+			last.resize(n);
+			for (auto const & rec : pending)
+				last(column[rec.first]) = rec.second;
+			rc = rolling_cov_init(n, window);
+			lowlat_buffer(&rc.ring);
+			lowlat_buffer(&rc.sumsq);
+			w = VectorXd::Constant(n, 1.0 / n);
+			v = VectorXd::Constant(n, 1.0 / sqrt((double) n));
+			shown = VectorXd::Zero(n);
+			return;
+		}
+		double t0 = lowlat_clock();
+		r = VectorXd::Zero(n);
+		for (auto const & rec : pending) {
+			auto it = column.find(rec.first);
+			if (it == column.end()) {
+				if (ignored.insert(rec.first).second)
+					warn("%s is not in the first bar, ignoring it\n", rec.first.c_str());
+				continue;
+			}
+			r(it->second) = (rec.second - last(it->second)) / last(it->second);
+			last(it->second) = rec.second;
+		}
+		rolling_cov_add(&rc, r);
+		if (rc.count < window) {
+			lowlat_record(t0);
+			return;
+		}
+		minvar_simplex(rolling_cov_matrix(rc), &w, &v, STREAM_MAXIT, STREAM_TOL);
+		lowlat_record(t0);
+		for (j = 0; j < n; j++) {
+			if (fabs(w(j) - shown(j)) > STREAM_MIN_DELTA) {
+				printf("%s %s %+.6f %.6f\n", bar.c_str(), tickers[j].c_str(), w(j) - shown(j), w(j));
+				shown(j) = w(j);
+			}
+		}
+		fflush(stdout);
+	};
+
+	n = 0;
+	while (fgets(buf, sizeof buf, stdin)) {
+		char *date, *ticker, *close, *endptr;
+		date = buf;
+		if (*date == '\n' && !pending.empty()) {
+			/* a blank line ends the bar, without waiting for the next one */
+			process();
+			pending.clear();
+			continue;
+		}
+		ticker = strchr(date, DATA_SEP);
+		close = ticker ? strchr(ticker + 1, DATA_SEP) : NULL;
+		if (!close)
+			continue;
+		*ticker++ = '\0';
+		*close++ = '\0';
+		double price = strtod(close, &endptr);
+		if (endptr == close || price <= 0.0)
+			continue;  /* a header, or a bad price */
+		if (bar != date) {
+			if (!pending.empty())
+				process();
+			pending.clear();
+			bar = date;
+		}
+		pending.emplace_back(upper(ticker), price);
+	}
+	if (!pending.empty())
+		process();
+}
+
+/* thread safe printf and cout */
+void tsprintf(char const *fmt, ...)
+{
+	static mutex m;
+	lock_guard<mutex> lock(m);
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stdout, fmt, args);
+	va_end(args);
+}
+
+template <typename T>
+ostream & tscout(T const & t)
+{
+	static mutex m;
+	lock_guard<mutex> lock(m);
+	cout << t << '\n';
+	return cout;
+}
+
+void usage(char const *argv0)
+{
+	printf(
+	"Usage: %s [-h|--help] [-u] [-c <float>] [-t <float>] [-r <float>] [-m <mode>] [-l <float>] [-o FILE] [-i PERIOD] [-e <estimator>] [-w] [-s N] [-L]\n"
+	"          [-v FILE] [-p FILE] [-b FILE] [-k N] [-a <float>] [-M N] [-g <generator>]\n"
+	"          [-x FILE] [-F] [-B FILE] [-j N]\n"
+	"    -h,--help           show this help message\n"
+	"    -c float            initial capital\n"
+	"    -t float            transaction cost per trade\n"
+	"    -r float            Minimum portfolio mean return, in percentage form (decimal)\n"
+	"    -m mode             optimization mode, one of:\n"
+	"                          sample  random portfolios, eliminating one stock at a time\n"
+	"                          glasso  minimum variance from a sparse inverse covariance\n"
+	"                          hrp     hierarchical risk parity, for large universes\n"
+	"                          track   least tracking error to the benchmark of -b\n"
+	"                          robust  least variance for which the worst case mean return,\n"
+	"                                  over the uncertainty of the means, meets -r\n"
+	"                          kelly   greatest average log growth over the weekly\n"
+	"                                  (or -i) returns\n"
+	"    -l float            graphical lasso penalty, applied to the correlation matrix\n"
+	"    -u                  keep stocks which only have prices for part of the period\n"
+	"                        (listed or delisted in between), using pairwise covariances\n"
+	"    -o FILE             out of core: write the covariance matrix to FILE a tile at a\n"
+	"                        time, and sample from a factor model of it. For universes\n"
+	"                        whose covariance matrix does not fit in memory\n"
+	"    -i PERIOD           intraday: the files hold bars or ticks with times, and returns\n"
+	"                        are taken over PERIOD (e.g. 30s, 5m, 1h) instead of weekly\n"
+	"    -e estimator        covariance estimator for -i, one of:\n"
+	"                          sample  sample covariance of the returns over each PERIOD\n"
+	"                          hy      Hayashi-Yoshida realized covariance of the ticks,\n"
+	"                                  which need not be synchronized\n"
+	"    -w                  watch: keep running, and as price files are written to the\n"
+	"                        data directories, update the covariances of their stocks and\n"
+	"                        print the portfolio again if the weights change materially.\n"
+	"                        Implies -m glasso, and no other mode can be used\n"
+	"    -s N                stream: read bars of date,ticker,close records from the\n"
+	"                        standard input, and print the changes in the long only\n"
+	"                        minimum variance weights as each bar arrives, from the\n"
+	"                        covariance of the last N returns\n"
+	"    -L                  low latency: pin threads to cores, keep the matrices in\n"
+	"                        locked huge pages, and print the median and 99th percentile\n"
+	"                        time per step (elimination step, bar or update) at exit\n"
+	"    -v FILE             Black-Litterman: expected returns from the equilibrium of\n"
+	"                        the market and the views in FILE, one per line, e.g.\n"
+	"                          JPM = 0.004\n"
+	"                          JPM - 0.5 BAC - 0.5 GS = 0.001 0.0005\n"
+	"                        for returns per period, optionally followed by their\n"
+	"                        standard deviation\n"
+	"    -p FILE             market weights for -v, lines of TICKER value (e.g. the\n"
+	"                        market capitalization). Equal weights if omitted\n"
+	"    -b FILE             benchmark weights for -m track, lines of TICKER weight\n"
+	"    -k N                hold at most N stocks in -m track\n"
+	"    -a float            size of the uncertainty of the means for -m robust, in\n"
+	"                        standard errors\n"
+	"    -M N                simulate N paths of the next 52 weeks (periods with -i) of\n"
+	"                        the value of the portfolio found, rebalanced every week,\n"
+	"                        and print the quantiles of its final value and drawdown\n"
+	"    -g generator        returns simulated by -M, one of:\n"
+	"                          normal     normal, with the portfolio's mean and variance\n"
+	"                          bootstrap  blocks of 4 consecutive historical returns\n"
+	"    -x FILE             stress test: print the returns of the portfolio (in sample\n"
+	"                        mode, the best portfolio of each number of stocks) over\n"
+	"                        the windows in FILE, one per line, e.g.\n"
+	"                          gfc 2008-09-01 2009-03-09\n"
+	"                        The windows need not be within the dates read\n"
+	"    -F                  print the frontier of the portfolios sampled in sample mode:\n"
+	"                        those which meet -r and no other has less variance and as\n"
+	"                        much return. With -x, the frontier is stress tested\n"
+	"    -B FILE             batch: solve the scenarios in FILE, one per line of\n"
+	"                          [BEGIN END] [MIN_RETURN]\n"
+	"                        in parallel processes, and print a line for each, and\n"
+	"                        its weights. Missing dates or return are those of the\n"
+	"                        standard input and -r. Built as main-mpi, the scenarios\n"
+	"                        go to MPI ranks instead: mpirun -np 8 ./main-mpi -B FILE\n"
+	"    -j N                number of worker processes for -B (default: one per core)\n"
+	"                        (not main-mpi, whose workers are the ranks)\n"
+	"\n"
+	"Default values\n"
+	"    -c %.1f\n"
+	"    -t %.2f\n"
+	"    -r %.3f\n"
+	"    -m sample\n"
+	"    -l %.2f\n"
+	"    -e sample\n"
+	"    -a %.1f\n"
+	"    -g normal\n"
+	"\n"
+	"Input Data\n"
+	"    From its standard input, the program reads:\n"
+	"        a starting date\n"
+	"        an ending date\n"
+	"        and a list of filenames\n"
+	"    The files must be in CSV format, with column labels\n"
+	"    With -i, the dates may have a time, YYYY-mm-ddTHH:MM:SS[.fraction] (UTC),\n"
+	"    and the files' times may also be nanoseconds since 1970-01-01\n"
+	"\n"
+	"Example usage (using the getstock program to get the data)\n"
+	"    $ ./getstock -k apikey -b 2018-01-01 -e 2018-04-01 -o data -- JPM BAC GS | %s -c 100000 -t 10.0 -r 0.02\n"
+	"\n"
+	,argv0
+	,DEFAULT_INITIAL_CAPITAL
+	,DEFAULT_TCOST
+	,DEFAULT_MIN_RETURN
+	,DEFAULT_GLASSO_LAMBDA
+	,DEFAULT_KAPPA
+	,argv0);
+	exit(1);
+}
+
+/*
+ * R = returns matrix
+ * risk = the covariance model, see chol_risk and factor_risk
+ * mean_returns = vector of the average returns for each security
+ * min_return = lower bound (measured in dollars) of the desired account value
+ * init_capital = the initial capital after accounting for transaction costs of purchasing the securities
+ * 'weights', 'variances', and 'returns' are output parameters containing the results of the simulation
+ *
+ * Returns the index [0,n) corresponding with the set of parameters for which the
+ * minimum return was satisfied and the variance was minimized.
+ * If there are no feasible solutions, -1 is returned.
+ */
+template <typename Risk>
+int run(MatrixXd const & R, Risk const & risk, VectorXd mean_returns,
+         int nsim, double min_return, double init_capital,
+	 vector<VectorXd> *weights,
+	 vector<double> *variances,
+	 vector<double> *returns)
+{
+	if (init_capital < 0) {
+		return -1;
+	}
+	int n;
+	int ncol;
+	ncol = risk.cols(); /* number of columns, or stocks/variables in dataset */
+#pragma omp parallel
+	{
+		if (omp_get_thread_num() == 0)
+			n = omp_get_num_threads();
+	}
+#pragma omp barrier
+
+#pragma omp parallel num_threads(n)
+	{
+		/* collecting stats, tl stands for 'thread-local'
+		 * we will aggregate all these together in 3 vectors, and report
+		 * our findings to the main thread after all these threads finish simulation.
+		 */ 
+		vector<VectorXd> tl_weights;
+		vector<double> tl_returns;
+		vector<double> tl_variances;
+
+		tl_weights.reserve(nsim / n);
+		tl_returns.reserve(nsim / n);
+		tl_variances.reserve(nsim / n);
+
+		VectorXd w;
+		w.resize(ncol);  /* one weight per security */
+
+		mt19937 engine(time(NULL));
+		uniform_real_distribution<double> dist(0.0, 1.0);
+
+		for (int i = 0; i < nsim / n; i++) {
+			// if (i % 50 == 0) {
+			// 	tsprintf("Thread %d on trial %d of %d\n", omp_get_thread_num(), i, nsim / n);
+			// }
+			/* make some random weights, ensure they sum up to one */
+			double sum = 0.0;
+			for (int k = 0; k < ncol; k++) {
+				double tmp = dist(engine);
+				w[k] = tmp;
+				sum += tmp;
+			}
+			for (int k = 0; k < ncol; k++) {
+				w[k] /= sum;
+			}
+			/* finally, compute the parameters (variance and mean) for this portfolio.
+			 * we only care to remember the parameters for which the resulting account value
+			 * is greater than or equal to the minimum account value specified */
+			double var = risk.variance(w);
+			double mu  = w.transpose() * mean_returns;
+			if (((mu + 1) * init_capital) >= min_return) {
+				tl_weights.push_back(w);
+				tl_variances.push_back(var);
+				tl_returns.push_back(mu);
+			}
+		}
+		/* 'move iterators' will call the move constructor when copying the thread_local
+		 * parameters back to the main thread. using the move constructor avoids deep copy of data.
+		 */
+#pragma omp critical
+		weights->insert(weights->end(), make_move_iterator(tl_weights.begin()),
+		                                make_move_iterator(tl_weights.end()));
+		variances->insert(variances->end(), tl_variances.begin(), tl_variances.end());
+		returns->insert(returns->end(),     tl_returns.begin(), tl_returns.end());
+	}
+#pragma omp barrier
+	// printf("Finished simulation with %d stocks\n", ncol);
+	auto found = min_element(variances->begin(), variances->end());
+	if (found == variances->end()) {
+		return -1;
+	}
+	return found - variances->begin();
+}
+
+/* remove the row at index rm from the matrix */
+void rmrow(MatrixXd & matrix, int rm)
+{
+	int nrow = matrix.rows() - 1;
+	int ncol = matrix.cols();
+
+	if (rm < nrow) {
+		matrix.block(rm, 0, nrow - rm, ncol) = matrix.block(rm + 1, 0, nrow - rm, ncol);
+	}
+	matrix.conservativeResize(nrow, ncol);
+}
+
+void rmcol(MatrixXd & matrix, int rm)
+{
+	int nrow = matrix.rows();
+	int ncol = matrix.cols() - 1;
+
+	if (rm < ncol) {
+		matrix.block(0, rm, nrow, ncol - rm) = matrix.block(0, rm + 1, nrow, ncol - rm);
+	}
+	matrix.conservativeResize(nrow, ncol);
+}
+
+/*
+ * chol_delete
+ *   given C = L * L', update L in place so that it is the Cholesky factor
+ *   of C with row and column 'rm' removed.
+ *
+ * Removing row 'rm' of L leaves rows rm..n-2 with a single entry above the
+ * diagonal. A sweep of Givens rotations over adjacent column pairs moves
+ * that entry back onto the diagonal, after which the last column is zero
+ * and can be dropped. This costs O(n^2), rather than the O(n^3) of
+ * factoring the smaller matrix again.
+ *
+ * chol_delete_block does this to the leading m-by-m block of L, without
+ * resizing L: the factor is left in the leading (m-1)-by-(m-1) block and
+ * row and column m-1 are zeroed.
+ */
+void chol_delete_block(MatrixXd & L, int m, int rm)
+{
+	int n, k, len;
+	double a, b, r, c, s;
+
+	n = m - 1;
+	if (rm < n) {
+		L.block(rm, 0, n - rm, m) = L.block(rm + 1, 0, n - rm, m);
+	}
+	/* the leading n-by-(n+1) block is L without row 'rm' */
+	for (k = rm; k < n; k++) {
+		a = L(k, k);
+		b = L(k, k + 1);
+		if (b == 0.0) {
+			continue;
+		}
+		r = hypot(a, b);
+		c = a / r;
+		s = b / r;
+		len = n - k;
+		VectorXd x = L.col(k).segment(k, len);
+		L.col(k).segment(k, len) = c * x + s * L.col(k + 1).segment(k, len);
+		L.col(k + 1).segment(k, len) = c * L.col(k + 1).segment(k, len) - s * x;
+		L(k, k) = r;
+		L(k, k + 1) = 0.0;
+	}
+	L.row(n).head(m).setZero();
+	L.col(n).head(m).setZero();
+}
+
+void chol_delete(MatrixXd & L, int rm)
+{
+	int n = L.rows() - 1;
+
+	chol_delete_block(L, n + 1, rm);
+	L.conservativeResize(n, n);
+}
+
+/* Remove element at index i */
+void eigen_vector_erase(VectorXd *v, int i)
+{
+	int size = v->size();
+	if (i < size - 1) {
+		v->segment(i, size - i - 1) = v->segment(i + 1, size - i - 1);
+	}
+	v->conservativeResize(size - 1);
+}
+
+/*
+ * chol_risk
+ *   the covariance model used by the sampler: w' * C * w = |L' * w|^2 with
+ *   C = L * L'. L' is triangular, so this is half the work of a full
+ *   matrix-vector product, and removing a stock is an O(n^2) downdate.
+ */
+struct chol_risk {
+	MatrixXd L;
+
+	int cols() const { return L.cols(); }
+	double variance(VectorXd const & w) const
+	{
+		return (L.transpose().triangularView<Upper>() * w).squaredNorm();
+	}
+	/* the downdate resizes L into a new buffer, see lowlat_buffer */
+	void remove(int i)
+	{
+		chol_delete(L, i);
+		lowlat_buffer(&L);
+	}
+};
+
+/*
+ * factor_risk
+ *   a k factor covariance model, C = F * F' + diag(d), see factor_model().
+ *   Variances cost O(nk), and it takes O(nk) memory instead of O(n^2).
+ */
+struct factor_risk {
+	MatrixXd F;   /* n-by-k factor loadings */
+	VectorXd d;   /* specific (idiosyncratic) variances */
+
+	int cols() const { return F.rows(); }
+	double variance(VectorXd const & w) const
+	{
+		return (F.transpose() * w).squaredNorm() + (d.array() * w.array().square()).sum();
+	}
+	void remove(int i)
+	{
+		rmrow(F, i);
+		eigen_vector_erase(&d, i);
+		lowlat_buffer(&F);
+	}
+};
+
+/*
+ * mapped_cov
+ *   an n-by-n covariance matrix, stored column major in a memory mapped file
+ *   so that it does not have to fit in memory (50,000 stocks take 20 GB).
+ */
+struct mapped_cov {
+	int n;
+	double *data;
+	size_t len;   /* in bytes */
+};
+
+/*
+ * tell the kernel it may evict the pages behind columns [j0, j1) of C, which
+ * are done with. The page the columns start in holds the end of the tile
+ * before, which is done with too, but the page they end in is shared with
+ * column j1 and is left for the next tile (unless j1 is the last column).
+ */
+static void mapped_cov_release(mapped_cov const & C, int j0, int j1)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = (uintptr_t) (C.data + (size_t) j0 * C.n);
+	uintptr_t end = (uintptr_t) (C.data + (size_t) j1 * C.n);
+
+	begin -= begin % page;
+	if (j1 < C.n)
+		end -= end % page;
+	else
+		end = (uintptr_t) C.data + ((C.len + page - 1) / page) * page;
+	if (end > begin)
+		madvise((void *) begin, end - begin, MADV_DONTNEED);
+}
+
+/* number of columns of C handled at a time, so that a tile is about OOC_TILE_BYTES */
+static int mapped_cov_tile(int n)
+{
+	return max(1, (int) (OOC_TILE_BYTES / (sizeof(double) * n)));
+}
+
+/*
+ * cov_mapped
+ *   like cov(), but the result is written to 'path' one tile of columns at a
+ *   time, and the tiles are dropped from memory as soon as they are written.
+ *
+ * Each tile is a single matrix product C(:, J) = Xc' * Xc(:, J) / (nrow - 1) of
+ * the centered returns, written straight into the mapping. We compute both
+ * halves of the symmetric matrix: with only a few hundred observations the
+ * cost is in writing C out, not in the arithmetic, and whole columns are
+ * written sequentially.
+ */
+mapped_cov cov_mapped(MatrixXd const & m, char const *path)
+{
+	mapped_cov C;
+	MatrixXd Xc;
+	int fd, nrow, tile, j0, j1;
+
+	nrow = m.rows();
+	C.n = m.cols();
+	C.len = sizeof(double) * C.n * C.n;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open");
+		die("Failed to create covariance file %s\n", path);
+	}
+	if (ftruncate(fd, C.len) == -1) {
+		perror("ftruncate");
+		die("Failed to allocate %zu bytes for %s\n", C.len, path);
+	}
+	C.data = (double *) mmap(NULL, C.len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (C.data == MAP_FAILED) {
+		perror("mmap");
+		die("Failed to map %s\n", path);
+	}
+	close(fd);  /* the mapping keeps the file open */
+
+	Xc = m.rowwise() - m.colwise().mean();
+	tile = mapped_cov_tile(C.n);
+	for (j0 = 0; j0 < C.n; j0 = j1) {
+		j1 = min(j0 + tile, C.n);
+		Map<MatrixXd> block(C.data + (size_t) j0 * C.n, C.n, j1 - j0);
+		block.noalias() = Xc.transpose() * Xc.middleCols(j0, j1 - j0) / (double) (nrow - 1);
+		mapped_cov_release(C, j0, j1);
+	}
+	return C;
+}
+
+/*
+ * factor_model
+ *   approximate a mapped covariance matrix by k factors, C ~ F * F' + diag(d).
+ *
+ * F holds the top k eigenvectors of C scaled by the square roots of their
+ * eigenvalues, found by subspace iteration. Every product C * Q streams over
+ * the tiles of C once, so only the n-by-k blocks stay in memory. The specific
+ * variances d make the diagonal of the model match C exactly.
+ */
+factor_risk factor_model(mapped_cov const & C, int k)
+{
+	int n, p, it, tile, j0, j1, i;
+	MatrixXd Q, Y, H;
+	factor_risk model;
+
+	n = C.n;
+	k = min(k, n);
+	p = min(k + OOC_OVERSAMPLE, n);  /* extra directions speed up convergence */
+	tile = mapped_cov_tile(n);
+	auto product = [&](MatrixXd const & Q) {
+		MatrixXd Y = MatrixXd::Zero(n, Q.cols());
+		for (j0 = 0; j0 < n; j0 = j1) {
+			j1 = min(j0 + tile, n);
+			Map<const MatrixXd> block(C.data + (size_t) j0 * n, n, j1 - j0);
+			Y.noalias() += block * Q.middleRows(j0, j1 - j0);
+			mapped_cov_release(C, j0, j1);
+		}
+		return Y;
+	};
+
+	Q = MatrixXd::Random(n, p);
+	for (it = 0; it <= OOC_ITERATIONS; it++) {
+		HouseholderQR<MatrixXd> qr(it == 0 ? Q : Y);
+		Q = qr.householderQ() * MatrixXd::Identity(n, p);
+		Y = product(Q);
+	}
+	/* Rayleigh-Ritz: the eigenpairs of Q' * C * Q give those of C */
+	H = Q.transpose() * Y;
+	SelfAdjointEigenSolver<MatrixXd> eig(0.5 * (H + H.transpose()));
+	VectorXd lambda = eig.eigenvalues().tail(k).cwiseMax(0.0);
+	model.F = Q * eig.eigenvectors().rightCols(k) * lambda.cwiseSqrt().asDiagonal();
+	model.d.resize(n);
+	for (i = 0; i < n; i++) {
+		model.d(i) = max(0.0, C.data[(size_t) i * n + i] - model.F.row(i).squaredNorm());
+	}
+	return model;
+}
+
+/*
+ * te_solve
+ *   the long only portfolio with the least tracking error to a benchmark b:
+ *     minimize (w - b)' C (w - b)  subject to  w >= 0, sum(w) = 1,
+ *                                   w_i = 0 where allowed[i] is 0
+ *   by a primal active set method, which is exact: it stops at a point which
+ *   satisfies the optimality conditions. *w must be feasible on entry.
+ *   Cb = C * b, computed once by the caller. Since the objective is
+ *   w' C w - 2 w' Cb + constant, any linear term will do: with Cb = lambda / 2 * mu
+ *   it is the mean-variance portfolio for risk tolerance lambda.
+ *
+ * The stocks with w_i > 0 are the free set F. On F the problem is an equality
+ * constrained least squares, solved with the Cholesky factor of C(F, F).
+ * That factor is updated as stocks enter F (a new row) or leave it
+ * (chol_delete_block), so a step costs O(k^2) for k stocks in F instead of a
+ * fresh O(k^3) factorization. L is allocated n-by-n once and the factor kept
+ * in its leading k-by-k block, so neither update reallocates it. The F of the
+ * start is factored in one go, which for a cold start with every stock free
+ * is one blocked factorization instead of n row updates. A small ridge keeps
+ * it positive definite when C is only semi-definite.
+ */
+void te_solve(MatrixXd const & C, VectorXd const & Cb, vector<char> const & allowed, VectorXd *w)
+{
+	int n, it, j, k;
+	double ridge, tol;
+	vector<int> F;
+	vector<char> inF;
+	MatrixXd L;
+
+	n = C.cols();
+	inF.assign(n, 0);
+	L = MatrixXd::Zero(n, n);
+	ridge = 1e-10 * C.trace() / n;
+	tol = 1e-12 * C.diagonal().maxCoeff();
+	auto add = [&](int i) {
+		int m = F.size();
+		VectorXd c(m);
+		for (int jj = 0; jj < m; jj++)
+			c(jj) = C(F[jj], i);
+		VectorXd l = L.topLeftCorner(m, m).triangularView<Lower>().solve(c);
+		double d2 = C(i, i) + ridge - l.squaredNorm();
+		L.row(m).head(m) = l.transpose();
+		L(m, m) = sqrt(max(d2, ridge));
+		F.push_back(i);
+		inF[i] = 1;
+	};
+	for (j = 0; j < n; j++) {
+		if ((*w)(j) > 0.0) {
+			F.push_back(j);
+			inF[j] = 1;
+		}
+	}
+	k = F.size();
+	if (k > 0) {
+		MatrixXd A(k, k);
+		for (j = 0; j < k; j++)
+			for (int i = 0; i < k; i++)
+				A(i, j) = C(F[i], F[j]);
+		A.diagonal().array() += ridge;
+		LLT<MatrixXd> llt(A);
+		if (llt.info() == Success) {
+			L.topLeftCorner(k, k) = llt.matrixL();
+		} else {
+			/* not numerically positive definite: the row updates clamp
+			 * each pivot at the ridge */
+			vector<int> start;
+			start.swap(F);
+			for (j = 0; j < k; j++)
+				add(start[j]);
+		}
+	}
+
+	for (it = 0; it < 10 * n + 100; it++) {
+		k = F.size();
+		VectorXd rhs(k), x;
+		for (j = 0; j < k; j++)
+			rhs(j) = Cb(F[j]);
+		auto T = L.topLeftCorner(k, k).triangularView<Lower>();
+		/* x = y + t z, with C(F, F) y = Cb(F) and C(F, F) z = 1, so that sum(x) = 1 */
+		VectorXd y = T.transpose().solve(T.solve(rhs));
+		VectorXd z = T.transpose().solve(T.solve(VectorXd::Ones(k)));
+		double t = (1.0 - y.sum()) / z.sum();
+		x = y + t * z;
+		if (x.minCoeff() >= 0.0) {
+			w->setZero();
+			for (j = 0; j < k; j++)
+				(*w)(F[j]) = x(j);
+			/* the multipliers of the stocks held at zero: g_i - t, where g is
+			 * half the gradient C w - C b. One which is negative would lower
+			 * the tracking error by entering. */
+			VectorXd g = -Cb;
+			for (j = 0; j < k; j++)
+				g += C.col(F[j]) * x(j);
+			int enter = -1;
+			double best = -tol;
+			for (int i = 0; i < n; i++) {
+				if (allowed[i] && !inF[i] && g(i) - t < best) {
+					best = g(i) - t;
+					enter = i;
+				}
+			}
+			if (enter == -1)
+				return;
+			add(enter);
+		} else {
+			/* step towards x until the first weight reaches zero, which leaves F */
+			double alpha = 1.0;
+			int leave = -1;
+			for (j = 0; j < k; j++) {
+				double wj = (*w)(F[j]);
+				if (x(j) < 0.0 && wj / (wj - x(j)) < alpha) {
+					alpha = wj / (wj - x(j));
+					leave = j;
+				}
+			}
+			for (j = 0; j < k; j++)
+				(*w)(F[j]) += alpha * (x(j) - (*w)(F[j]));
+			(*w)(F[leave]) = 0.0;
+			inF[F[leave]] = 0;
+			chol_delete_block(L, k, leave);
+			F.erase(F.begin() + leave);
+		}
+	}
+	warn("te_solve: no convergence after %d iterations\n", it);
+}
+
+/*
+ * track_portfolio
+ *   print the long only portfolio of at most 'maxnames' stocks (0 for no
+ *   limit) with the least tracking error to the benchmark weights b.
+ *   The limit on the number of names makes the problem combinatorial, so as
+ *   in sample_portfolio we eliminate: solve, drop the stock with the least
+ *   weight, and solve again from the remaining weights, until few enough are
+ *   left. C * b does not change, so it is computed once.
+ */
+VectorXd track_portfolio(vector<string> const & tickers, MatrixXd const & C, VectorXd const & mean_returns,
+                         VectorXd b, int maxnames)
+{
+	int n, i, names;
+	VectorXd Cb, w, d;
+	vector<char> allowed;
+
+	n = C.cols();
+	b /= b.sum();
+	Cb = C * b;
+	allowed.assign(n, 1);
+	w = b;
+	te_solve(C, Cb, allowed, &w);
+	for (;;) {
+		names = (w.array() > 0.0).count();
+		if (maxnames <= 0 || names <= maxnames)
+			break;
+		double least = numeric_limits<double>::infinity();
+		int drop = -1;
+		for (i = 0; i < n; i++) {
+			if (w(i) > 0.0 && w(i) < least) {
+				least = w(i);
+				drop = i;
+			}
+		}
+		allowed[drop] = 0;
+		w(drop) = 0.0;
+		w /= w.sum();
+		te_solve(C, Cb, allowed, &w);
+	}
+
+	d = w - b;
+	printf("Minimum tracking error, %d names\n", names);
+	for (i = 0; i < n; i++) {
+		if (w(i) > 0.0)
+			printf("%s %10.6f\n", tickers[i].c_str(), w(i));
+	}
+	printf("Expected return: %.6f (benchmark %.6f)\n", w.dot(mean_returns), b.dot(mean_returns));
+	printf("Tracking error:  %.6f\n", sqrt(max(0.0, d.dot(C * d))));
+	printf("net weight: %.4f\n", w.sum());
+	return w;
+}
+
+/*
+ * robust_portfolio
+ *   print the long only portfolio of least variance whose worst case expected
+ *   return, over an ellipsoid of means around mean_returns, is at least
+ *   min_return:
+ *     minimize w' C w  subject to  mu' w - kappa * ||S^1/2 w|| >= min_return,
+ *                                  w >= 0, sum(w) = 1
+ *   S is the covariance of the sample mean, C / T for T returns, so the
+ *   constraint reads mu' w - kappa / sqrt(T) * sigma(w) >= min_return.
+ *
+ * This is a second order cone program, but because S is a multiple of C it
+ * need not be solved as one. Any solution can be replaced by the efficient
+ * portfolio with the same mean and no more variance, which is also feasible,
+ * so the answer is on the long only efficient frontier: the portfolio there
+ * with the least sigma whose worst case return is min_return. The frontier
+ * portfolios are exact quadratic programs, minimize w' C w - lambda mu' w
+ * (te_solve), each warm started from the last, and we look for lambda by a
+ * doubling scan and then bisection. Along the frontier the worst case return
+ * is concave in sigma, so if it is still short when it starts to fall, we
+ * look for its maximum; if that is short too there is no solution.
+ */
+VectorXd robust_portfolio(vector<string> const & tickers, MatrixXd const & C, VectorXd const & mean_returns,
+                          int T, double min_return, double kappa)
+{
+	int n, i, k;
+	double lambda, lo, hi, lambda0, h, hprev, k_se;
+	VectorXd w, wlo, whi;
+	vector<char> allowed;
+
+	n = C.cols();
+	k_se = kappa / sqrt((double) T);
+	allowed.assign(n, 1);
+	auto solve = [&](double l, VectorXd *x) {
+		VectorXd c = (l / 2.0) * mean_returns;
+		te_solve(C, c, allowed, x);
+		return mean_returns.dot(*x) - k_se * sqrt(max(0.0, x->dot(C * *x)));
+	};
+
+	w = VectorXd::Constant(n, 1.0 / n);
+	h = solve(0.0, &w);   /* minimum variance */
+	lo = 0.0;
+	wlo = w;
+	hi = -1.0;
+	hprev = h;
+	lambda0 = w.dot(C * w) / max(mean_returns.cwiseAbs().maxCoeff(), 1e-300) * 1e-3;
+	for (k = 0, lambda = lambda0; h < min_return && k < 100; k++, lambda *= 2.0) {
+		h = solve(lambda, &w);
+		if (h >= min_return) {
+			hi = lambda;
+			whi = w;
+			break;
+		}
+		if (h < hprev) {
+			/* past the best worst case, which is between lambda / 4 and lambda.
+			 * Look for it by ternary search, stopping as soon as one is good enough */
+			double a = lambda / 4.0, b = lambda;
+			for (i = 0; i < 60 && hi < 0.0; i++) {
+				double m1 = a + (b - a) / 3.0, m2 = b - (b - a) / 3.0;
+				VectorXd w1 = w, w2 = w;
+				double h1 = solve(m1, &w1), h2 = solve(m2, &w2);
+				if (h1 >= min_return || h2 >= min_return) {
+					hi = (h1 >= min_return) ? m1 : m2;
+					whi = (h1 >= min_return) ? w1 : w2;
+				} else if (h1 < h2) {
+					a = m1;
+				} else {
+					b = m2;
+				}
+			}
+			/* the worst case is short at lambda / 4, and rising from there to hi */
+			lo = lambda / 4.0;
+			break;
+		}
+		hprev = h;
+		lo = lambda;
+		wlo = w;
+	}
+	if (h < min_return && hi < 0.0) {
+		printf("Solution unfeasible\n");
+		return VectorXd();
+	}
+	if (hi > 0.0) {
+		/* the least lambda, so the least variance, which still meets min_return */
+		for (i = 0; i < 60 && hi - lo > 1e-12 * hi; i++) {
+			double mid = (lo + hi) / 2.0;
+			w = wlo;
+			h = solve(mid, &w);
+			if (h >= min_return) {
+				hi = mid;
+				whi = w;
+			} else {
+				lo = mid;
+				wlo = w;
+			}
+		}
+		w = whi;
+	}
+
+	double var = w.dot(C * w);
+	printf("Robust mean-variance, kappa = %.2f\n", kappa);
+	for (i = 0; i < n; i++) {
+		if (w(i) > 0.0)
+			printf("%s %10.6f\n", tickers[i].c_str(), w(i));
+	}
+	printf("Expected return: %.6f (worst case %.6f)\n", w.dot(mean_returns),
+	       w.dot(mean_returns) - k_se * sqrt(var));
+	printf("Min variance:    %.6f\n", var);
+	printf("net weight: %.4f\n", w.sum());
+	return w;
+}
+
+/*
+ * kelly_hessian
+ *   R' diag(d) R, the Hessian of the average log growth up to sign and
+ *   scale, accumulated KELLY_BLOCK scenarios at a time by rank-k updates.
+ *   Each thread sums the blocks it is given, then their upper triangles are
+ *   added together.
+ */
+static MatrixXd kelly_hessian(MatrixXd const & R, VectorXd const & d)
+{
+	int n, T, nblocks;
+	MatrixXd H;
+
+	n = R.cols();
+	T = R.rows();
+	nblocks = (T + KELLY_BLOCK - 1) / KELLY_BLOCK;
+	H = MatrixXd::Zero(n, n);
+#pragma omp parallel if (nblocks > 1) num_threads(min(nblocks, omp_get_max_threads()))
+	{
+		MatrixXd Hp = MatrixXd::Zero(n, n), X;
+#pragma omp for schedule(static)
+		for (int b = 0; b < nblocks; b++) {
+			int r0 = b * KELLY_BLOCK, k = min(KELLY_BLOCK, T - r0);
+			X = d.segment(r0, k).cwiseSqrt().asDiagonal() * R.middleRows(r0, k);
+			Hp.selfadjointView<Upper>().rankUpdate(X.transpose());
+		}
+#pragma omp critical
+		H.triangularView<Upper>() += Hp;
+	}
+	return H.selfadjointView<Upper>();
+}
+
+/*
+ * kelly_weights
+ *   the long only, fully invested portfolio of greatest average log growth
+ *   over the scenarios in the rows of R:
+ *     maximize 1/T sum_t log(1 + R(t,:) w)  subject to  w >= 0, sum(w) = 1
+ *   by a barrier method: Newton's method on the log growth plus
+ *   mu * sum(log(w)), for a falling sequence of mu. Each Newton step
+ *   eliminates the budget constraint through two solves with the Cholesky
+ *   factor of the Hessian. Returns the log growth, w is overwritten.
+ */
+double kelly_weights(MatrixXd const & R, VectorXd *w)
+{
+	int n, T, it;
+	double mu, f;
+	VectorXd &x = *w, g, a, b, dx, p;
+
+	n = R.cols();
+	T = R.rows();
+	x = VectorXd::Constant(n, 1.0 / n);
+	/* the barrier term, scaled by mu, of the objective we minimize */
+	auto objective = [&](VectorXd const & y, VectorXd const & q) {
+		return -q.array().log().sum() / T - mu * y.array().log().sum();
+	};
+	for (mu = 1e-4; ; mu *= 0.1) {
+		for (it = 0; it < 100; it++) {
+			p = VectorXd::Ones(T) + R * x;   /* growth of each scenario */
+			g = -R.transpose() * p.cwiseInverse() / T - mu * x.cwiseInverse();
+			MatrixXd H = kelly_hessian(R, p.array().square().inverse().matrix()) / T;
+			H.diagonal() += mu * x.array().square().inverse().matrix();
+			LLT<MatrixXd> llt(H);
+			a = llt.solve(g);
+			b = llt.solve(VectorXd::Ones(n));
+			dx = -a + (a.sum() / b.sum()) * b;   /* sum(dx) = 0 */
+			double decrement = -g.dot(dx);
+			if (decrement / 2.0 < KELLY_TOL)
+				break;
+			/* stay inside the domain, then backtrack to sufficient decrease */
+			double s = 1.0;
+			for (int i = 0; i < n; i++) {
+				if (dx(i) < 0.0)
+					s = min(s, -0.99 * x(i) / dx(i));
+			}
+			VectorXd Rdx = R * dx;
+			for (int t = 0; t < T; t++) {
+				if (Rdx(t) < 0.0)
+					s = min(s, -0.99 * p(t) / Rdx(t));
+			}
+			f = objective(x, p);
+			while (s > 1e-12 && objective(x + s * dx, p + s * Rdx) > f - 0.25 * s * decrement)
+				s *= 0.5;
+			x += s * dx;
+		}
+		/* the gap to the true optimum is at most n * mu */
+		if (n * mu < KELLY_TOL)
+			break;
+	}
+	return (VectorXd::Ones(T) + R * x).array().log().mean();
+}
+
+VectorXd kelly_portfolio(vector<string> const & tickers, MatrixXd const & R, MatrixXd const & C,
+                         VectorXd const & mean_returns)
+{
+	VectorXd w;
+	double growth = kelly_weights(R, &w);
+
+	printf("Growth optimal (Kelly), over %d scenarios\n", (int) R.rows());
+	for (int i = 0; i < (int) tickers.size(); i++) {
+		if (w(i) > KELLY_MIN_WEIGHT)
+			printf("%s %10.6f\n", tickers[i].c_str(), w(i));
+	}
+	printf("Expected return: %.6f\n", w.dot(mean_returns));
+	printf("Log growth:      %.6f\n", growth);
+	printf("Variance:        %.6f\n", w.dot(C * w));
+	printf("net weight: %.4f\n", w.sum());
+	return w;
+}
+
+/*
+ * rng
+ *   xoshiro256+ (Blackman and Vigna 2018), seeded through splitmix64. Small
+ *   and fast enough to draw the hundreds of millions of variates of a
+ *   simulation, with each chunk of paths given its own generator so the
+ *   results do not depend on the number of threads.
+ */
+struct rng {
+	uint64_t s[4];
+};
+
+static inline uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+rng rng_seed(uint64_t seed)
+{
+	rng g;
+	for (int i = 0; i < 4; i++)
+		g.s[i] = splitmix64(&seed);
+	return g;
+}
+
+static inline uint64_t rng_next(rng *g)
+{
+	uint64_t *s = g->s;
+	uint64_t r = s[0] + s[3], t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+	return r;
+}
+
+/* uniform in (0, 1) */
+static inline double rng_uniform(rng *g)
+{
+	return ((rng_next(g) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/* n standard normals, n even, by the Box-Muller transform */
+static void rng_normals(rng *g, double *z, int n)
+{
+	for (int i = 0; i < n; i += 2) {
+		double r = sqrt(-2.0 * log(rng_uniform(g)));
+		double a = 2.0 * M_PI * rng_uniform(g);
+		z[i] = r * cos(a);
+		z[i + 1] = r * sin(a);
+	}
+}
+
+/*
+ * simulate_portfolio
+ *   simulate 'npaths' paths of SIM_STEPS returns of a portfolio held at
+ *   weights w, rebalanced every period, and print the quantiles of the
+ *   final value of initial_capital and of the largest drawdown along the
+ *   way. Since the weights are constant, each period's return of the
+ *   portfolio is w' r, so the paths are of that scalar alone:
+ *     SIM_NORMAL     w' r ~ N(w' mean_returns, w' C w), exactly when r is
+ *                    multivariate normal
+ *     SIM_BOOTSTRAP  blocks of SIM_BLOCK consecutive historical returns R w,
+ *                    from random starting periods (wrapping around the end)
+ *   C may be empty, in which case the variance of R w is used.
+ *   Paths are done SIM_CHUNK at a time, one period at a time across the chunk.
+ */
+void simulate_portfolio(VectorXd const & w, MatrixXd const & R, MatrixXd const & C,
+                        VectorXd const & mean_returns, double initial_capital,
+                        long npaths, int method)
+{
+	VectorXd hist;
+	vector<double> final, drawdown;
+	double mu, sigma;
+	long nchunks;
+	int T;
+
+	hist = R * w;
+	T = hist.size();
+	mu = w.dot(mean_returns);
+	if (C.size() > 0)
+		sigma = sqrt(max(0.0, w.dot(C * w)));
+	else
+		sigma = sqrt((hist.array() - hist.mean()).square().sum() / (T - 1));
+	final.resize(npaths);
+	drawdown.resize(npaths);
+	nchunks = (npaths + SIM_CHUNK - 1) / SIM_CHUNK;
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (long c = 0; c < nchunks; c++) {
+		long p0 = c * SIM_CHUNK;
+		int m = (int) min((long) SIM_CHUNK, npaths - p0);
+		double x[SIM_CHUNK], v[SIM_CHUNK], peak[SIM_CHUNK], dd[SIM_CHUNK];
+		int ix[SIM_CHUNK];
+		rng g = rng_seed(SIM_SEED + c);
+
+		for (int i = 0; i < m; i++) {
+			v[i] = peak[i] = 1.0;
+			dd[i] = 0.0;
+		}
+		for (int t = 0; t < SIM_STEPS; t++) {
+			if (method == SIM_NORMAL) {
+				rng_normals(&g, x, (m + 1) & ~1);
+				for (int i = 0; i < m; i++)
+					x[i] = mu + sigma * x[i];
+			} else {
+				for (int i = 0; i < m; i++) {
+					if (t % SIM_BLOCK == 0)
+						ix[i] = (int) (rng_uniform(&g) * T);
+					else if (++ix[i] == T)
+						ix[i] = 0;
+					x[i] = hist(ix[i]);
+				}
+			}
+			for (int i = 0; i < m; i++) {
+				v[i] = max(0.0, v[i] * (1.0 + x[i]));
+				peak[i] = max(peak[i], v[i]);
+				dd[i] = max(dd[i], 1.0 - v[i] / peak[i]);
+			}
+		}
+		for (int i = 0; i < m; i++) {
+			final[p0 + i] = initial_capital * v[i];
+			drawdown[p0 + i] = dd[i];
+		}
+	}
+
+	double mean = 0.0;
+	for (double f : final)
+		mean += f / npaths;
+	long losses = count_if(final.begin(), final.end(), [=](double f) { return f < initial_capital; });
+	sort(final.begin(), final.end());
+	sort(drawdown.begin(), drawdown.end());
+	printf("Simulated %ld paths of %d returns (%s), initial capital %.1f\n", npaths, SIM_STEPS,
+	       (method == SIM_NORMAL) ? "normal" : "block bootstrap", initial_capital);
+	printf("quantile   final value   max drawdown\n");
+	for (double q : { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 }) {
+		long k = min(npaths - 1, (long) (q * npaths));
+		printf("%7.0f%% %13.2f %13.4f\n", 100.0 * q, final[k], drawdown[k]);
+	}
+	printf("Mean final value: %.2f\n", mean);
+	printf("Probability of a loss: %.4f\n", (double) losses / npaths);
+}
+
+/* a crisis window for -x */
+struct stress_window {
+	string name;
+	time_t begin, end;
+};
+
+/*
+ * read_windows
+ *   read stress windows, one per line:
+ *     NAME BEGIN END
+ *   e.g.
+ *     gfc 2008-09-01 2009-03-09
+ *   with dates as for the standard input. '#' starts a comment.
+ */
+vector<stress_window> read_windows(char const *path)
+{
+	vector<stress_window> windows;
+	FILE *file;
+	char buf[256];
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		die("Failed to read stress windows\n");
+	}
+	while (fgets(buf, sizeof buf, file)) {
+		char *hash = strchr(buf, '#');
+		if (hash)
+			*hash = '\0';
+		char *name = strtok(buf, " \t\r\n,");
+		char *b = name ? strtok(NULL, " \t\r\n,") : NULL;
+		char *e = b ? strtok(NULL, " \t\r\n,") : NULL;
+		if (!name)
+			continue;
+		stress_window sw = { name, e ? strtotime(b) : 0, e ? strtotime(e) : 0 };
+		if (sw.begin == 0 || sw.end == 0 || sw.end <= sw.begin)
+			die("Bad stress window in %s: %s\n", path, name);
+		windows.push_back(sw);
+	}
+	fclose(file);
+	if (windows.empty())
+		die("No stress windows in %s\n", path);
+	return windows;
+}
+
+/*
+ * stress_returns
+ *   the return of each of 'tickers' over each window, from the first to the
+ *   last closing price it has in the window, as a windows x tickers matrix.
+ *   The prices are read afresh from the files over the span of the windows,
+ *   which need not be inside the period the portfolios were fitted on. A
+ *   stock with fewer than two prices in a window is taken to return 0 there,
+ *   unless no stock has, when the window's row is NaN: there is no data.
+ */
+MatrixXd stress_returns(vector<string> const & files, vector<string> const & tickers,
+                        vector<stress_window> const & windows)
+{
+	time_t start, end;
+	map<string, int> column;
+	MatrixXd S;
+	int i, j, k;
+
+	start = windows[0].begin;
+	end = windows[0].end;
+	for (auto const & sw : windows) {
+		start = min(start, sw.begin);
+		end = max(end, sw.end);
+	}
+	panel pn = read_panel(files, start, end);
+	for (j = 0; j < (int) pn.tickers.size(); j++)
+		column[pn.tickers[j]] = j;
+
+	S = MatrixXd::Zero(windows.size(), tickers.size());
+	for (k = 0; k < (int) windows.size(); k++) {
+		int r0 = lower_bound(pn.dates.begin(), pn.dates.end(), windows[k].begin) - pn.dates.begin();
+		int r1 = upper_bound(pn.dates.begin(), pn.dates.end(), windows[k].end) - pn.dates.begin();
+		vector<int> missing;
+		for (i = 0; i < (int) tickers.size(); i++) {
+			auto it = column.find(tickers[i]);
+			int a = r0, b = r1 - 1;
+			if (it != column.end()) {
+				j = it->second;
+				while (a < r1 && !pn.active(a, j))
+					a++;
+				while (b > a && !pn.active(b, j))
+					b--;
+			}
+			if (it == column.end() || b <= a) {
+				missing.push_back(i);
+				continue;
+			}
+			S(k, i) = pn.prices(b, j) / pn.prices(a, j) - 1.0;
+		}
+		if (!missing.empty() && missing.size() == tickers.size()) {
+			warn("No prices in %s, leaving it out\n", windows[k].name.c_str());
+			S.row(k).setConstant(numeric_limits<double>::quiet_NaN());
+			continue;
+		}
+		for (int m : missing)
+			warn("No prices for %s in %s, taking its return to be 0\n",
+			     tickers[m].c_str(), windows[k].name.c_str());
+	}
+	return S;
+}
+
+/*
+ * stress_test
+ *   print the return of every candidate portfolio (the rows of W, over the
+ *   same stocks as the columns of S) in every stress window, all at once
+ *   as W S', and each portfolio's worst window. Windows without data (NaN,
+ *   see stress_returns) print as n/a and are left out of the worst.
+ */
+void stress_test(MatrixXd const & W, vector<string> const & labels, MatrixXd const & S,
+                 vector<stress_window> const & windows)
+{
+	MatrixXd L = W * S.transpose();
+
+	printf("Stress test, %d portfolios over %d windows\n", (int) W.rows(), (int) S.rows());
+	printf("%-12s", "portfolio");
+	for (auto const & sw : windows)
+		printf(" %10.10s", sw.name.c_str());
+	printf(" %10s\n", "worst");
+	for (int p = 0; p < (int) L.rows(); p++) {
+		double worst = numeric_limits<double>::infinity();
+		printf("%-12s", labels[p].c_str());
+		for (int k = 0; k < (int) L.cols(); k++) {
+			if (isnan(L(p, k))) {
+				printf(" %10s", "n/a");
+				continue;
+			}
+			printf(" %10.4f", L(p, k));
+			worst = min(worst, L(p, k));
+		}
+		if (isinf(worst))
+			printf(" %10s\n", "n/a");
+		else
+			printf(" %10.4f\n", worst);
+	}
+}
+
+/* portfolios to stress test, with a label for each */
+struct candidates {
+	vector<string> labels;
+	vector<VectorXd> weights;
+};
+
+/* a sampled portfolio on the frontier, see frontier_merge */
+struct frontier_point {
+	double var, mu;
+	VectorXd w;   /* over all the stocks */
+};
+
+/*
+ * frontier_sweep
+ *   keep the indices into var, mu of the points no other point dominates, in
+ *   order of increasing variance: sort by variance (ties by decreasing
+ *   return), then keep each point which returns more than all before it.
+ */
+static void frontier_sweep(vector<int> *ix, double const *var, double const *mu)
+{
+	sort(ix->begin(), ix->end(), [=](int a, int b) {
+		return var[a] < var[b] || (var[a] == var[b] && mu[a] > mu[b]);
+	});
+	double best = -numeric_limits<double>::infinity();
+	int k = 0;
+	for (int i : *ix) {
+		if (mu[i] > best) {
+			best = mu[i];
+			(*ix)[k++] = i;
+		}
+	}
+	ix->resize(k);
+}
+
+/*
+ * frontier_merge
+ *   add the samples of a run which are not dominated (by a portfolio of no
+ *   more variance and at least as much return) to 'front', and drop the
+ *   points of 'front' they dominate. The samples are swept a FRONTIER_BLOCK
+ *   at a time in parallel, and only the survivors of each block are merged
+ *   and swept again, so besides the samples themselves memory stays at a
+ *   block per thread. 'expand' spreads a sample's weights over all the stocks.
+ */
+template <typename Expand>
+void frontier_merge(vector<frontier_point> *front, vector<VectorXd> const & weights,
+                    vector<double> const & variances, vector<double> const & returns,
+                    Expand expand)
+{
+	int n, nf, nblocks;
+	vector<int> keep, ix;
+	vector<double> var, mu;
+	vector<frontier_point> merged;
+
+	n = variances.size();
+	nblocks = (n + FRONTIER_BLOCK - 1) / FRONTIER_BLOCK;
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int b = 0; b < nblocks; b++) {
+		vector<int> block;
+		for (int i = b * FRONTIER_BLOCK; i < min(n, (b + 1) * FRONTIER_BLOCK); i++)
+			block.push_back(i);
+		frontier_sweep(&block, variances.data(), returns.data());
+#pragma omp critical
+		keep.insert(keep.end(), block.begin(), block.end());
+	}
+
+	/* points [0, nf) are the old frontier, then the survivors */
+	nf = front->size();
+	for (auto const & p : *front) {
+		var.push_back(p.var);
+		mu.push_back(p.mu);
+	}
+	for (int i : keep) {
+		var.push_back(variances[i]);
+		mu.push_back(returns[i]);
+	}
+	for (int i = 0; i < (int) var.size(); i++)
+		ix.push_back(i);
+	frontier_sweep(&ix, var.data(), mu.data());
+	for (int i : ix) {
+		if (i < nf)
+			merged.push_back(move((*front)[i]));
+		else
+			merged.push_back({ var[i], mu[i], expand(weights[keep[i - nf]]) });
+	}
+	front->swap(merged);
+}
+
+void frontier_print(vector<frontier_point> const & front)
+{
+	printf("Frontier of the sampled portfolios, %d points\n", (int) front.size());
+	printf("%12s %12s %7s\n", "variance", "return", "stocks");
+	for (auto const & p : front)
+		printf("%12.6f %12.6f %7d\n", p.var, p.mu, (int) (p.w.array() > 0.0).count());
+}
+
+/*
+ * sample_portfolio
+ *   run the sampler on all the stocks, then repeatedly remove a stock and
+ *   run it again. Print the portfolio with the least variance found.
+ *   'risk' is the covariance model the sampler uses, see chol_risk and factor_risk.
+ *   Returns the weights of all of 'tickers', empty if no portfolio was feasible.
+ *   If 'rounds' is given, the least variance portfolio of each round of the
+ *   elimination is added to it, and if 'front' is, the non-dominated samples
+ *   of all the rounds are kept in it.
+ */
+template <typename Risk>
+VectorXd sample_portfolio(MatrixXd R, Risk risk, VectorXd mean_returns, vector<string> tickers,
+                          double initial_capital, double min_return, double tcost,
+                          candidates *rounds = NULL, vector<frontier_point> *front = NULL)
+{
+	int optimal_nstocks;
+	VectorXd optimal_weights;
+	VectorXd exp_returns;
+	double min_var = 10000000.0;
+	optimal_nstocks = -1;
+
+	/* FIXME: eliminate any variables with a negative mean-return */
+	vector<VectorXd> weights;
+	vector<double> variances;
+	vector<double> returns;
+	vector<string> optimal_tickers;
+	vector<string> const all_tickers = tickers;
+	/* weights over 'names', spread out over all_tickers */
+	auto expand = [&](VectorXd const & x, vector<string> const & names) -> VectorXd {
+		VectorXd y = VectorXd::Zero(all_tickers.size());
+		for (int i = 0, k = 0; i < (int) x.size(); i++, k++) {
+			while (all_tickers[k] != names[i])
+				k++;
+			y(k) = x(i);
+		}
+		return y;
+	};
+	while (risk.cols() > 2) {
+		double t0 = lowlat_clock();
+		int i = run(R, risk, mean_returns, 3000,
+		           (initial_capital * (min_return + 1)), initial_capital - (risk.cols() * tcost),
+			   &weights, &variances, &returns);
+		if (i == -1) {
+			/* problem was infeasible, and no data recorded.
+			 * remove stock with the lowest expected return and try again.
+			 */
+			i = min_element(mean_returns.data(),mean_returns.data() + mean_returns.size()) - mean_returns.data();
+			eigen_vector_erase(&mean_returns, i);
+			rmcol(R, i);
+			risk.remove(i);
+			lowlat_buffer(&R);
+			tickers.erase(tickers.begin() + i);
+			lowlat_record(t0);
+			continue;
+		}
+		/* we found a feasible solution. if the variance of this solution is lesser than that
+		 * which we've seen so far, consider this to be a better solution.
+		 */
+		double new_min_var = variances[i];
+		if (front) {
+			frontier_merge(front, weights, variances, returns,
+			               [&](VectorXd const & x) { return expand(x, tickers); });
+		}
+		if (rounds) {
+			rounds->labels.push_back(to_string(risk.cols()) + " stocks");
+			rounds->weights.push_back(expand(weights[i], tickers));
+		}
+		if (new_min_var < min_var) {
+			optimal_nstocks = risk.cols();
+			optimal_weights = weights[i];
+			exp_returns = mean_returns;
+			min_var = new_min_var;
+			optimal_tickers.assign(tickers.begin(), tickers.end());
+		}
+		/* remove variable with the least weighting in the portfolio */
+		if (optimal_weights.size() > 0) {
+			i = min_element(optimal_weights.data(),optimal_weights.data()+optimal_weights.size()) - optimal_weights.data();
+			rmcol(R, i);
+			risk.remove(i);
+			lowlat_buffer(&R);
+			eigen_vector_erase(&mean_returns, i);
+			tickers.erase(tickers.begin() + i);
+		}
+
+		weights.clear();
+		variances.clear();
+		returns.clear();
+		lowlat_record(t0);
+	}
+	if (optimal_nstocks != -1) {
+		printf("Optimal number of stocks: %d\n",optimal_nstocks);
+		double test = 0;
+		for (int i = 0; i < optimal_nstocks; i++) {
+			printf("%s %10.6f\n", optimal_tickers[i].c_str(), optimal_weights[i]);
+			test += optimal_weights[i];
+		}
+		printf("Expected return: %.6f\n", (exp_returns.array() * optimal_weights.array()).sum());
+		printf("Min variance:    %.6f\n", min_var);
+		printf("net weight: %.4f\n", test);
+	} else {
+		printf("Solution unfeasible\n");
+		return VectorXd();
+	}
+	return expand(optimal_weights, optimal_tickers);
+}
+
+/* a scenario of a batch (-B): a window and a minimum return */
+struct scenario {
+	time_t begin, end;
+	double min_return;
+};
+
+/* how the scenarios of a batch are solved, from the command line */
+struct batch_params {
+	int mode;
+	double initial_capital, tcost, lambda, kappa;
+	int maxnames;
+	string bench_file;
+};
+
+/*
+ * read_scenarios
+ *   read a batch of scenarios, one per line:
+ *     [BEGIN END] [MIN_RETURN]
+ *   Lines without dates are for the dates from the standard input, lines
+ *   without a minimum return use -r. '#' starts a comment.
+ */
+vector<scenario> read_scenarios(char const *path, time_t begin, time_t end, double min_return)
+{
+	vector<scenario> batch;
+	FILE *file;
+	char buf[256];
+	int line = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		die("Failed to read scenarios\n");
+	}
+	while (fgets(buf, sizeof buf, file)) {
+		char *tok[4], *endptr;
+		int n = 0;
+
+		line++;
+		char *hash = strchr(buf, '#');
+		if (hash)
+			*hash = '\0';
+		for (char *t = strtok(buf, " \t\r\n,"); t && n < 4; t = strtok(NULL, " \t\r\n,"))
+			tok[n++] = t;
+		if (n == 0)
+			continue;
+		scenario sc = { begin, end, min_return };
+		if (n >= 2) {
+			sc.begin = strtotime(tok[0]);
+			sc.end = strtotime(tok[1]);
+		}
+		if (n == 1 || n == 3) {
+			sc.min_return = strtod(tok[n - 1], &endptr);
+			if (endptr == tok[n - 1])
+				sc.begin = 0;
+		}
+		if (n > 3 || sc.begin == 0 || sc.end <= sc.begin)
+			die("Bad scenario on line %d of %s\n", line, path);
+		batch.push_back(sc);
+	}
+	fclose(file);
+	if (batch.empty())
+		die("No scenarios in %s\n", path);
+	return batch;
+}
+
+/*
+ * batch_solve
+ *   read the prices for one scenario and find its portfolio as main would,
+ *   into a record of BATCH_HEAD + universe.size() doubles:
+ *     index, 1 if feasible (-1 if the prices could not be read), expected
+ *     return, variance, weights over 'universe'
+ *   The portfolio functions print as usual, so callers send stdout elsewhere.
+ */
+void batch_solve(int index, scenario const & sc, vector<string> files, vector<string> const & universe,
+                 batch_params const & bp, double *rec)
+{
+	vector<string> tickers;
+	MatrixXd R, C;
+	VectorXd mean_returns, w;
+	map<string, vector<double> > data;
+
+	fill(rec, rec + BATCH_HEAD + universe.size(), 0.0);
+	rec[0] = index;
+	if (load_stock_data(files, sc.begin, sc.end, &data) == -1) {
+		rec[1] = -1.0;
+		return;
+	}
+	if (data.size() < 3)
+		return;
+	R = stockReturns(data, &tickers);
+	if (R.rows() < 2)
+		return;
+	C = cov(R);
+	mean_returns = R.colwise().mean();
+	if (bp.mode == MODE_HRP) {
+		w = hrp_portfolio(tickers, C, mean_returns);
+	} else if (bp.mode == MODE_ROBUST) {
+		w = robust_portfolio(tickers, C, mean_returns, R.rows(), sc.min_return, bp.kappa);
+	} else if (bp.mode == MODE_KELLY) {
+		w = kelly_portfolio(tickers, R, C, mean_returns);
+	} else if (bp.mode == MODE_TRACK) {
+		VectorXd b = read_weights(bp.bench_file.c_str(), tickers);
+		if (b.minCoeff() < 0.0 || b.sum() <= 0.0)
+			return;
+		w = track_portfolio(tickers, C, mean_returns, b, bp.maxnames);
+	} else if (bp.mode == MODE_GLASSO) {
+		w = glasso_portfolio(tickers, C, mean_returns, bp.lambda);
+	} else {
+		chol_risk risk = { chol(C) };
+		w = sample_portfolio(R, risk, mean_returns, tickers,
+		                     bp.initial_capital, sc.min_return, bp.tcost);
+	}
+	if (w.size() == 0)
+		return;
+	rec[1] = 1.0;
+	rec[2] = w.dot(mean_returns);
+	rec[3] = w.dot(C * w);
+	for (int i = 0; i < (int) tickers.size(); i++) {
+		int k = lower_bound(universe.begin(), universe.end(), tickers[i]) - universe.begin();
+		if (k < (int) universe.size() && universe[k] == tickers[i])
+			rec[BATCH_HEAD + k] = w(i);
+	}
+}
+
+static int write_all(int fd, void const *buf, size_t n)
+{
+	char const *p = (char const *) buf;
+	while (n > 0) {
+		ssize_t k = write(fd, p, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return -1;
+		p += k;
+		n -= k;
+	}
+	return 0;
+}
 
-		mt19937 engine(time(NULL));
-		uniform_real_distribution<double> dist(0.0, 1.0);
+static int read_all(int fd, void *buf, size_t n)
+{
+	char *p = (char *) buf;
+	while (n > 0) {
+		ssize_t k = read(fd, p, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return -1;
+		p += k;
+		n -= k;
+	}
+	return 0;
+}
 
-		for (int i = 0; i < nsim / n; i++) {
-			// if (i % 50 == 0) {
-			// 	tsprintf("Thread %d on trial %d of %d\n", omp_get_thread_num(), i, nsim / n);
-			// }
-			/* make some random weights, ensure they sum up to one */
-			double sum = 0.0;
-			for (int k = 0; k < ncol; k++) {
-				double tmp = dist(engine);
-				w[k] = tmp;
-				sum += tmp;
-			}
-			for (int k = 0; k < ncol; k++) {
-				w[k] /= sum;
-			}
-			/* finally, compute the parameters (variance and mean) for this portfolio.
-			 * we only care to remember the parameters for which the resulting account value
-			 * is greater than or equal to the minimum account value specified */
-			double var = w.transpose() * C * w;
-			double mu  = w.transpose() * mean_returns;
-			if (((mu + 1) * init_capital) >= min_return) {
-				tl_weights.push_back(w);
-				tl_variances.push_back(var);
-				tl_returns.push_back(mu);
+/*
+ * batch_fork
+ *   solve the scenarios in 'nworkers' forked processes, worker p taking
+ *   scenarios p, p + nworkers, ..., and sharing the cores between them.
+ *   Each writes its records down a pipe, into the rows of 'results'.
+ *   The rows of scenarios whose worker died have -1 feasibility. The workers'
+ *   stdout goes to /dev/null and their warnings to stderr.
+ */
+void batch_fork(vector<scenario> const & batch, vector<string> const & files,
+                vector<string> const & universe, batch_params const & bp,
+                int nworkers, MatrixXd *results)
+{
+	int ns, reclen, nthreads;
+	vector<int> fds;
+	vector<pid_t> pids;
+	vector<double> rec;
+
+	ns = batch.size();
+	reclen = BATCH_HEAD + universe.size();
+	nworkers = min(nworkers, ns);
+	nthreads = max(1, omp_get_num_procs() / nworkers);
+	rec.resize(reclen);
+	fflush(stdout);
+	for (int p = 0; p < nworkers; p++) {
+		int fd[2];
+		if (pipe(fd) == -1)
+			die("pipe: %s\n", strerror(errno));
+		pid_t pid = fork();
+		if (pid == -1)
+			die("fork: %s\n", strerror(errno));
+		if (pid == 0) {
+			close(fd[0]);
+			int devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, STDOUT_FILENO);
+			diagnostics = stderr;
+			omp_set_num_threads(nthreads);
+			for (int i = p; i < ns; i += nworkers) {
+				batch_solve(i, batch[i], files, universe, bp, rec.data());
+				if (write_all(fd[1], rec.data(), reclen * sizeof(double)) == -1)
+					_exit(1);
 			}
+			_exit(0);
 		}
-		/* 'move iterators' will call the move constructor when copying the thread_local
-		 * parameters back to the main thread. using the move constructor avoids deep copy of data.
-		 */
-#pragma omp critical
-		weights->insert(weights->end(), make_move_iterator(tl_weights.begin()),
-		                                make_move_iterator(tl_weights.end()));
-		variances->insert(variances->end(), tl_variances.begin(), tl_variances.end());
-		returns->insert(returns->end(),     tl_returns.begin(), tl_returns.end());
+		close(fd[1]);
+		fds.push_back(fd[0]);
+		pids.push_back(pid);
 	}
-#pragma omp barrier
-	// printf("Finished simulation with %d stocks\n", ncol);
-	auto found = min_element(variances->begin(), variances->end());
-	if (found == variances->end()) {
-		return -1;
+
+	*results = MatrixXd::Zero(ns, reclen);
+	for (int i = 0; i < ns; i++) {
+		(*results)(i, 0) = i;
+		(*results)(i, 1) = -1.0;
+	}
+	for (int p = 0; p < nworkers; p++) {
+		while (read_all(fds[p], rec.data(), reclen * sizeof(double)) == 0) {
+			int i = (int) rec[0];
+			if (i >= 0 && i < ns)
+				results->row(i) = Map<RowVectorXd>(rec.data(), reclen);
+		}
+		close(fds[p]);
+		waitpid(pids[p], NULL, 0);
 	}
-	return found - variances->begin();
 }
 
-/* remove the row at index rm from the matrix */
-void rmrow(MatrixXd & matrix, int rm)
+#ifdef USE_MPI
+typedef Matrix<double, Dynamic, Dynamic, RowMajor> RowMajorMatrixXd;
+
+/*
+ * mpi_share_input
+ *   under mpirun only rank 0 gets the standard input: send the other ranks
+ *   the dates and files it read
+ */
+void mpi_share_input(string *begin_date, string *end_date, vector<string> *files)
 {
-	int nrow = matrix.rows() - 1;
-	int ncol = matrix.cols();
+	string buf;
+	long len;
 
-	if (rm < nrow) {
-		matrix.block(rm, 0, nrow - rm, ncol) = matrix.block(rm + 1, 0, nrow - rm, ncol);
+	if (mpi_rank == 0) {
+		buf = *begin_date + "\n" + *end_date + "\n";
+		for (auto const & f : *files)
+			buf += f + "\n";
 	}
-	matrix.conservativeResize(nrow, ncol);
+	len = buf.size();
+	MPI_Bcast(&len, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+	buf.resize(len);
+	MPI_Bcast(&buf[0], len, MPI_CHAR, 0, MPI_COMM_WORLD);
+	if (mpi_rank == 0)
+		return;
+	vector<string> lines;
+	for (size_t i = 0, j; i < buf.size(); i = j + 1) {
+		j = buf.find('\n', i);
+		lines.push_back(buf.substr(i, j - i));
+	}
+	*begin_date = lines[0];
+	*end_date = lines[1];
+	files->assign(lines.begin() + 2, lines.end());
 }
 
-void rmcol(MatrixXd & matrix, int rm)
+/*
+ * batch_mpi
+ *   solve the scenarios over the MPI ranks, rank r taking scenarios r,
+ *   r + size, ..., and sum the records into 'results' on rank 0. Rank 0
+ *   solves its share with stdout sent to /dev/null and warnings to stderr,
+ *   like the other ranks.
+ */
+void batch_mpi(vector<scenario> const & batch, vector<string> const & files,
+               vector<string> const & universe, batch_params const & bp, MatrixXd *results)
 {
-	int nrow = matrix.rows();
-	int ncol = matrix.cols() - 1;
+	int ns, reclen, saved, devnull;
+	RowMajorMatrixXd mine;
 
-	if (rm < ncol) {
-		matrix.block(0, rm, nrow, ncol - rm) = matrix.block(0, rm + 1, nrow, ncol - rm);
-	}
-	matrix.conservativeResize(nrow, ncol);
+	ns = batch.size();
+	reclen = BATCH_HEAD + universe.size();
+	mine = RowMajorMatrixXd::Zero(ns, reclen);
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+	diagnostics = stderr;
+	for (int i = mpi_rank; i < ns; i += mpi_size)
+		batch_solve(i, batch[i], files, universe, bp, mine.row(i).data());
+	diagnostics = stdout;
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	close(devnull);
+
+	RowMajorMatrixXd all(ns, reclen);
+	MPI_Reduce(mine.data(), all.data(), ns * reclen, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+	*results = all;
 }
+#endif
 
-/* Remove element at index i */
-void eigen_vector_erase(VectorXd *v, int i)
+/*
+ * batch_print
+ *   a line per scenario, then the weights of each feasible one
+ */
+void batch_print(vector<scenario> const & batch, vector<string> const & universe,
+                 MatrixXd const & results, int nworkers)
 {
-	int size = v->size();
-	if (i < size - 1) {
-		v->segment(i, size - i - 1) = v->segment(i + 1, size - i - 1);
+	char b[64], e[64];
+
+	printf("Batch of %d scenarios over %d workers\n", (int) batch.size(), nworkers);
+	printf("%8s %10s %10s %10s %12s %12s %7s\n", "scenario", "begin", "end", "min return",
+	       "exp return", "variance", "stocks");
+	for (int i = 0; i < (int) batch.size(); i++) {
+		timetostr(batch[i].begin, b);
+		timetostr(batch[i].end, e);
+		printf("%8d %10s %10s %10.4f ", i + 1, b, e, batch[i].min_return);
+		if (results(i, 1) > 0.0) {
+			int held = (results.row(i).tail(universe.size()).array() != 0.0).count();
+			printf("%12.6f %12.6f %7d\n", results(i, 2), results(i, 3), held);
+		} else if (results(i, 1) < 0.0) {
+			printf("%12s\n", "failed");
+		} else {
+			printf("%12s\n", "unfeasible");
+		}
+	}
+	for (int i = 0; i < (int) batch.size(); i++) {
+		if (results(i, 1) <= 0.0)
+			continue;
+		printf("Scenario %d\n", i + 1);
+		for (int k = 0; k < (int) universe.size(); k++) {
+			if (results(i, BATCH_HEAD + k) != 0.0)
+				printf("%s %10.6f\n", universe[k].c_str(), results(i, BATCH_HEAD + k));
+		}
 	}
-	v->conservativeResize(size - 1);
 }
 
 int main(int argc, char **argv)
@@ -583,11 +4373,56 @@ int main(int argc, char **argv)
 	double initial_capital;
 	double min_return;   /* required rate of return */
 	double tcost;        /* transaction cost, USD */
+	int mode;
+	double lambda;       /* graphical lasso penalty */
+	int survivors;       /* keep tickers which only cover part of the window */
+	int outofcore;       /* keep the covariance matrix in a file, see cov_mapped */
+	string cov_file;
+	timestamp period;    /* length of the intraday returns, 0 for weekly returns of daily data */
+	int estimator;
+	int watch;           /* keep running, and update as files change, see watch_portfolio */
+	int window;          /* stream mode, see stream_portfolio */
+	int low_latency;     /* see lowlat_init */
+	string views_file;   /* Black-Litterman views, see read_views */
+	string prior_file;   /* market weights for Black-Litterman */
+	string bench_file;   /* benchmark weights for -m track */
+	int maxnames;        /* limit on the number of stocks for -m track, 0 for none */
+	double kappa;        /* size of the uncertainty set for -m robust */
+	long npaths;         /* paths to simulate after the portfolio is found, see simulate_portfolio */
+	int generator;
+	string stress_file;  /* crisis windows to stress test the portfolios in, see read_windows */
+	int frontier;        /* print the frontier of the sampled portfolios, see frontier_merge */
+	string batch_file;   /* scenarios to solve in parallel processes, see read_scenarios */
+	int nworkers;
 
 	initial_capital = 0.0;
+	period = 0;
+	estimator = EST_SAMPLE;
+	watch = 0;
+	window = 0;
+	low_latency = 0;
+	maxnames = 0;
+	kappa = DEFAULT_KAPPA;
+	npaths = 0;
+	frontier = 0;
+	nworkers = 0;
+	generator = SIM_NORMAL;
 	min_return = 0.0;
 	tcost = 0.0;
+	mode = -1;   /* -m, or the default of -w or sample mode, see below */
+	lambda = DEFAULT_GLASSO_LAMBDA;
+	survivors = 0;
+	outofcore = 0;
 
+#ifdef USE_MPI
+	MPI_Init(&argc, &argv);
+	MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+	atexit(mpi_finalize);
+	/* rank 0 does the talking */
+	if (mpi_rank > 0 && !freopen("/dev/null", "w", stdout))
+		return 1;
+#endif
 	char const *argv0 = argv[0];
 	int ac;
 	char **av;
@@ -628,6 +4463,146 @@ int main(int argc, char **argv)
 				}
 				brk_ = 1;
 				break;
+			case 'm':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				if (strcmp(tmp, "sample") == 0) {
+					mode = MODE_SAMPLE;
+				} else if (strcmp(tmp, "glasso") == 0) {
+					mode = MODE_GLASSO;
+				} else if (strcmp(tmp, "hrp") == 0) {
+					mode = MODE_HRP;
+				} else if (strcmp(tmp, "track") == 0) {
+					mode = MODE_TRACK;
+				} else if (strcmp(tmp, "robust") == 0) {
+					mode = MODE_ROBUST;
+				} else if (strcmp(tmp, "kelly") == 0) {
+					mode = MODE_KELLY;
+				} else {
+					die("Unknown mode: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'l':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				lambda = strtod(tmp, &endptr);
+				if (lambda <= 0.0 || endptr == tmp) {
+					die("Failed to parse lambda: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'u':
+				survivors = 1;
+				break;
+			case 'o':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				outofcore = 1;
+				cov_file = tmp;
+				brk_ = 1;
+				break;
+			case 's':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				window = strtol(tmp, &endptr, 10);
+				if (window < 2 || endptr == tmp) {
+					die("Failed to parse window: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'L':
+				low_latency = 1;
+				break;
+			case 'v':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				views_file = tmp;
+				brk_ = 1;
+				break;
+			case 'p':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				prior_file = tmp;
+				brk_ = 1;
+				break;
+			case 'b':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				bench_file = tmp;
+				brk_ = 1;
+				break;
+			case 'a':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				kappa = strtod(tmp, &endptr);
+				if (kappa < 0.0 || endptr == tmp) {
+					die("Failed to parse kappa: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'k':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				maxnames = strtol(tmp, &endptr, 10);
+				if (maxnames < 1 || endptr == tmp) {
+					die("Failed to parse the number of stocks: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'M':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				npaths = strtol(tmp, &endptr, 10);
+				if (npaths < 1 || endptr == tmp) {
+					die("Failed to parse the number of paths: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'g':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				if (strcmp(tmp, "normal") == 0) {
+					generator = SIM_NORMAL;
+				} else if (strcmp(tmp, "bootstrap") == 0) {
+					generator = SIM_BOOTSTRAP;
+				} else {
+					die("Unknown generator: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'x':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				stress_file = tmp;
+				brk_ = 1;
+				break;
+			case 'F':
+				frontier = 1;
+				break;
+			case 'B':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				batch_file = tmp;
+				brk_ = 1;
+				break;
+			case 'j':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				nworkers = strtol(tmp, &endptr, 10);
+				if (nworkers < 1 || endptr == tmp) {
+					die("Failed to parse the number of workers: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'w':
+				watch = 1;
+				break;
+			case 'e':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				if (strcmp(tmp, "sample") == 0) {
+					estimator = EST_SAMPLE;
+				} else if (strcmp(tmp, "hy") == 0) {
+					estimator = EST_HY;
+				} else {
+					die("Unknown estimator: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
+			case 'i':
+				tmp = (opt[1] != '\0') ? (opt + 1) : (--ac, *(++av));
+				period = parse_period(tmp);
+				if (period == 0) {
+					die("Failed to parse period: %s\n", tmp);
+				}
+				brk_ = 1;
+				break;
 			case 'h':
 				usage(argv0);
 			default:
@@ -648,27 +4623,133 @@ int main(int argc, char **argv)
 		printf("Mean Return = %.4f\n", min_return);
 	}
 
+	/* watch mode only keeps a glasso portfolio up to date */
+	if (watch && mode != -1 && mode != MODE_GLASSO) {
+		die("-w can only be used with -m glasso\n");
+	}
+	if (mode == -1)
+		mode = watch ? MODE_GLASSO : MODE_SAMPLE;
+	if (outofcore && (survivors || mode != MODE_SAMPLE)) {
+		die("-o can only be used in sample mode, without -u\n");
+	}
+	if (period && survivors) {
+		die("-i can not be used with -u\n");
+	}
+	if (watch && (survivors || outofcore || period)) {
+		die("-w can not be used with -u, -o or -i\n");
+	}
+	if (estimator != EST_SAMPLE && (!period || outofcore)) {
+		die("-e can only be used with -i, without -o\n");
+	}
+	if (mode == MODE_TRACK && bench_file.empty()) {
+		die("-m track needs benchmark weights, -b FILE\n");
+	}
+	if (!views_file.empty() && (outofcore || watch || window)) {
+		die("-v can not be used with -o, -w or -s\n");
+	}
+	if (!prior_file.empty() && views_file.empty()) {
+		die("-p is the market for -v, and can not be used without it\n");
+	}
+	if (npaths && (watch || window)) {
+		die("-M can not be used with -w or -s\n");
+	}
+	if (!stress_file.empty() && (watch || window || period)) {
+		die("-x can not be used with -w, -s or -i\n");
+	}
+	if (frontier && (mode != MODE_SAMPLE || watch || window)) {
+		die("-F can only be used in sample mode\n");
+	}
+	if (!batch_file.empty() && (survivors || outofcore || period || watch || window ||
+	                            !views_file.empty() || npaths || !stress_file.empty() || frontier)) {
+		die("-B can not be used with -u, -o, -i, -w, -s, -v, -M, -x or -F\n");
+	}
+#ifdef USE_MPI
+	if (nworkers) {
+		die("-j can not be used with MPI, there is a worker per rank\n");
+	}
+#endif
+	if (low_latency)
+		lowlat_init(window || watch);
+	if (window) {
+		if (survivors || outofcore || period || watch) {
+			die("-s can not be used with -u, -o, -i or -w\n");
+		}
+		stream_portfolio(window);
+		return 0;
+	}
+
 	/* begin_date, end_date are the periods to run the backtest on */
 	string begin_date;
 	string end_date;
-	time_t begin, end;
+	time_t begin = 0, end = 0;
+	timestamp tbegin = 0, tend = 0;   /* with -i */
 
-	cin >> begin_date;
-	cin >> end_date;
-	begin = strtotime(begin_date.c_str());
-	end = strtotime(end_date.c_str());
-	if (begin == 0) {
-		die("Error parsing date: %s\n", begin_date.c_str());
-	}
-	if (end == 0) {
-		die("Error parsing date: %s\n", end_date.c_str());
-	}
-	/* gather a list of filenames from the standard input */
+	/* gather the dates and a list of filenames from the standard input */
 	vector<string> files;
 	string tmp;
+	cin >> begin_date;
+	cin >> end_date;
 	while (cin >> tmp) {
 		files.emplace_back(tmp);
 	}
+#ifdef USE_MPI
+	mpi_share_input(&begin_date, &end_date, &files);
+#endif
+	if (period || watch) {
+		/* times of day are allowed, and a plain end date covers the whole day */
+		char const *b = begin_date.c_str(), *e = end_date.c_str(), *endp;
+		tbegin = parse_timestamp(b, b + begin_date.size(), &endp);
+		if (endp != b + begin_date.size()) {
+			die("Error parsing date: %s\n", b);
+		}
+		tend = parse_timestamp(e, e + end_date.size(), &endp);
+		if (endp != e + end_date.size()) {
+			die("Error parsing date: %s\n", e);
+		}
+		if (end_date.size() == 10)
+			tend += 86400 * NS_PER_SEC - 1;
+	}
+	if (!period) {
+		begin = strtotime(begin_date.c_str());
+		end = strtotime(end_date.c_str());
+		if (begin == 0) {
+			die("Error parsing date: %s\n", begin_date.c_str());
+		}
+		if (end == 0) {
+			die("Error parsing date: %s\n", end_date.c_str());
+		}
+	}
+	if (!batch_file.empty()) {
+		vector<scenario> batch = read_scenarios(batch_file.c_str(), begin, end, min_return);
+		batch_params bp = { mode, initial_capital, tcost, lambda, kappa, maxnames, bench_file };
+		vector<string> universe;
+		MatrixXd results;
+		for (auto const & f : files)
+			universe.push_back(ticker_from_filename(f.c_str()));
+		sort(universe.begin(), universe.end());
+		universe.erase(unique(universe.begin(), universe.end()), universe.end());
+#ifdef USE_MPI
+		batch_mpi(batch, files, universe, bp, &results);
+		if (mpi_rank == 0)
+			batch_print(batch, universe, results, mpi_size);
+#else
+		if (nworkers == 0)
+			nworkers = omp_get_num_procs();
+		nworkers = min(nworkers, (int) batch.size());
+		batch_fork(batch, files, universe, bp, nworkers, &results);
+		batch_print(batch, universe, results, nworkers);
+#endif
+		return 0;
+	}
+#ifdef USE_MPI
+	/* only a batch and the covariance matrix of weekly returns are shared
+	 * out, anything else runs on rank 0 */
+	if (mpi_rank > 0) {
+		if (!survivors && !period && !outofcore)
+			cov_ring(MatrixXd());
+		return 0;
+	}
+#endif
 
 	/* here, data is a map of the tickers (string) to a vector (array) of prices.
 	 * we compute the weekly returns of the assets and stick them in an Eigen Matrix.
@@ -676,87 +4757,152 @@ int main(int argc, char **argv)
 	 * so we know which column in the matrix corresponds with which security
 	 */
 	MatrixXd R;
-	int nrow, colIndex;
+	int nrow = 0;   /* prices per stock, daily data only (as for -w) */
 	vector<string> tickers;
-	vector<string> optimal_tickers;
-
-	auto data = read_stock_data(files, begin, end);
-	// printf("data.size = %zu\n",data.size());
-	nrow = (*data.begin()).second.size();  /* the number of prices we have for each stock */
-	// printf("nrow = %d\n", nrow);
-	R.resize(nrow / 5, data.size());       /* divide by five b/c weekly returns... one column per stock */
-	colIndex = 0;
-	for (auto & d : data) {
-		auto ticker = d.first;
-		auto & prices = d.second;
-		tickers.push_back(ticker);
-		R.col(colIndex++) = weeklyReturns(prices);
-	}
-	MatrixXd C = cov(R);
 
-	int optimal_nstocks;
-	VectorXd optimal_weights;
-	VectorXd exp_returns;
-	double min_var = 10000000.0;
-	optimal_nstocks = -1;
+	MatrixXd C;
+	VectorXd mean_returns;
 
-	VectorXd mean_returns = R.colwise().mean();
-	/* FIXME: eliminate any variables with a negative mean-return */
-	vector<VectorXd> weights;
-	vector<double> variances;
-	vector<double> returns;
-	while (C.cols() > 2) {
-		int i = run(R, C, mean_returns, 3000,
-		           (initial_capital * (min_return + 1)), initial_capital - (C.cols() * tcost),
-			   &weights, &variances, &returns);
-		if (i == -1) {
-			/* problem was infeasible, and no data recorded.
-			 * remove stock with the lowest expected return and try again.
-			 */
-			i = min_element(mean_returns.data(),mean_returns.data() + mean_returns.size()) - mean_returns.data();
-			eigen_vector_erase(&mean_returns, i);
-			rmcol(R, i);
-			rmrow(C, i);
-			rmcol(C, i);
-			continue;
+	if (survivors) {
+		/* every ticker with at least two weekly returns in the window takes part,
+		 * and covariances use whatever weeks each pair has in common */
+		MatrixXd M, N;
+		auto pn = read_panel(files, begin, end);
+		panelReturns(pn, &R, &M);
+		vector<int> ixrm;
+		for (int j = 0; j < (int) pn.tickers.size(); j++) {
+			if (M.col(j).sum() < 2) {
+				warn("Not enough observations for %s\n", pn.tickers[j].c_str());
+				ixrm.push_back(j);
+			}
 		}
-		/* we found a feasible solution. if the variance of this solution is lesser than that
-		 * which we've seen so far, consider this to be a better solution.
-		 */
-		double new_min_var = variances[i];
-		if (new_min_var < min_var) {
-			optimal_nstocks = C.cols();
-			optimal_weights = weights[i];
-			exp_returns = mean_returns;
-			min_var = new_min_var;
-			optimal_tickers.assign(tickers.begin(), tickers.end());
+		for (int k = ixrm.size() - 1; k >= 0; k--) {
+			rmcol(R, ixrm[k]);
+			rmcol(M, ixrm[k]);
 		}
-		/* remove variable with the least weighting in the portfolio */
-		if (optimal_weights.size() > 0) {
-			i = min_element(optimal_weights.data(),optimal_weights.data()+optimal_weights.size()) - optimal_weights.data();
-			rmcol(R, i);
-			rmrow(C, i);
-			rmcol(C, i);
-			eigen_vector_erase(&mean_returns, i);
-			tickers.erase(tickers.begin() + i);
+		pn.tickers.erase(index_remove(ixrm.begin(), ixrm.end(), pn.tickers), pn.tickers.end());
+		tickers = pn.tickers;
+		/* the matrix products in cov_masked win when the panel is nearly full,
+		 * the bitmask kernel when there are many gaps to skip */
+		if (M.mean() > PAIRWISE_FILL_THRESHOLD)
+			C = cov_masked(R, M, &N);
+		else
+			C = cov_pairwise(R, M, &N);
+		mean_returns = R.colwise().sum().transpose().cwiseQuotient(M.colwise().sum().transpose());
+	} else if (period) {
+		auto data = read_intraday(files, tbegin, tend);
+		if (data.empty()) {
+			die("No data\n");
+		}
+		R = periodReturns(data, period);
+		if (R.rows() < 2) {
+			die("Not enough periods between the first and last times\n");
 		}
+		for (auto const & d : data)
+			tickers.push_back(d.first);
+		if (estimator == EST_HY)
+			C = cov_hy(data, period);
+		else if (!outofcore)
+			C = cov(R);
+		mean_returns = R.colwise().mean();
+	} else {
+		auto data = read_stock_data(files, begin, end);
+		// printf("data.size = %zu\n",data.size());
+		nrow = (*data.begin()).second.size();  /* the number of prices we have for each stock */
+		R = stockReturns(data, &tickers);
+#ifdef USE_MPI
+		if (!outofcore)
+			C = cov_ring(R);
+#else
+		if (!outofcore)
+			C = cov(R);
+#endif
+		mean_returns = R.colwise().mean();
+	}
 
-		weights.clear();
-		variances.clear();
-		returns.clear();
+	if (!views_file.empty()) {
+		MatrixXd P;
+		VectorXd Q, sd, w;
+		if (prior_file.empty()) {
+			w = VectorXd::Constant(tickers.size(), 1.0 / tickers.size());
+		} else {
+			w = read_weights(prior_file.c_str(), tickers);
+			if (w.sum() <= 0.0) {
+				die("No market weights for these stocks in %s\n", prior_file.c_str());
+			}
+			w /= w.sum();
+		}
+		read_views(views_file.c_str(), tickers, &P, &Q, &sd);
+		mean_returns = black_litterman(C, w, P, Q, sd);
+		printf("Black-Litterman expected returns, from %d views\n", (int) P.rows());
 	}
-	if (optimal_nstocks != -1) {
-		printf("Optimal number of stocks: %d\n",optimal_nstocks);
-		double test = 0;
-		for (int i = 0; i < optimal_nstocks; i++) {
-			printf("%s %10.6f\n", optimal_tickers[i].c_str(), optimal_weights[i]);
-			test += optimal_weights[i];
+	if (watch) {
+		watch_portfolio(files, tickers, move(R), move(C), move(mean_returns), nrow, tbegin, tend, lambda);
+	}
+	VectorXd w;
+	candidates cands;
+	if (mode == MODE_HRP) {
+		w = hrp_portfolio(tickers, C, mean_returns);
+	} else if (mode == MODE_ROBUST) {
+		w = robust_portfolio(tickers, C, mean_returns, R.rows(), min_return, kappa);
+	} else if (mode == MODE_KELLY) {
+		w = kelly_portfolio(tickers, R, C, mean_returns);
+	} else if (mode == MODE_TRACK) {
+		VectorXd b = read_weights(bench_file.c_str(), tickers);
+		if (b.minCoeff() < 0.0 || b.sum() <= 0.0) {
+			die("Benchmark weights in %s must be positive, for some of these stocks\n", bench_file.c_str());
 		}
-		printf("Expected return: %.6f\n", (exp_returns.array() * optimal_weights.array()).sum());
-		printf("Min variance:    %.6f\n", min_var);
-		printf("net weight: %.4f\n", test);
+		w = track_portfolio(tickers, C, mean_returns, b, maxnames);
+	} else if (mode == MODE_GLASSO) {
+		w = glasso_portfolio(tickers, C, mean_returns, lambda);
 	} else {
-		printf("Solution unfeasible\n");
+		/* the sampler is handed R and the means, so keep copies for -M */
+		MatrixXd Rs = npaths ? R : MatrixXd();
+		VectorXd ms = npaths ? mean_returns : VectorXd();
+		candidates *rounds = (stress_file.empty() || frontier) ? NULL : &cands;
+		vector<frontier_point> front;
+		if (outofcore) {
+			/* C was never held in memory: the sampler works from a factor model */
+			mapped_cov Cm = cov_mapped(R, cov_file.c_str());
+			factor_risk risk = factor_model(Cm, OOC_FACTORS);
+			munmap(Cm.data, Cm.len);
+			lowlat_buffer(&R);
+			lowlat_buffer(&risk.F);
+			w = sample_portfolio(move(R), move(risk), move(mean_returns), tickers,
+			                     initial_capital, min_return, tcost, rounds,
+			                     frontier ? &front : NULL);
+		} else {
+			chol_risk risk = { chol(C) };
+			lowlat_buffer(&R);
+			lowlat_buffer(&risk.L);
+			w = sample_portfolio(move(R), move(risk), move(mean_returns), tickers,
+			                     initial_capital, min_return, tcost, rounds,
+			                     frontier ? &front : NULL);
+		}
+		R = move(Rs);
+		mean_returns = move(ms);
+		if (frontier) {
+			frontier_print(front);
+			/* the frontier is what -x tests */
+			for (int p = 0; p < (int) front.size(); p++) {
+				cands.labels.push_back("frontier " + to_string(p + 1));
+				cands.weights.push_back(move(front[p].w));
+			}
+		}
+	}
+	if (npaths && w.size() > 0)
+		simulate_portfolio(w, R, C, mean_returns, initial_capital, npaths, generator);
+	if (!stress_file.empty() && w.size() > 0) {
+		/* the sampler's portfolio of each round, or else the one portfolio found */
+		if (cands.weights.empty()) {
+			cands.labels.push_back("portfolio");
+			cands.weights.push_back(w);
+		}
+		MatrixXd W(cands.weights.size(), w.size());
+		for (int p = 0; p < W.rows(); p++)
+			W.row(p) = cands.weights[p];
+		auto windows = read_windows(stress_file.c_str());
+		stress_test(W, cands.labels, stress_returns(files, tickers, windows), windows);
 	}
 	return 0;
 }